@@ -149,9 +149,10 @@ bool CAlert::RelayTo(CNode* pnode) const
     // don't relay to nodes which haven't sent their version message
     if (pnode->nVersion == 0)
         return false;
-    // returns true if wasn't already contained in the set
-    if (pnode->setKnown.insert(GetHash()).second)
+    uint256 hash = GetHash();
+    if (!pnode->alertKnown.contains(hash))
     {
+        pnode->alertKnown.insert(hash);
         if (AppliesTo(pnode->nVersion, pnode->strSubVer) ||
             AppliesToMe() ||
             GetTime() < nRelayUntil)
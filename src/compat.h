@@ -47,6 +47,16 @@
 #include <unistd.h>
 #endif
 
+// poll() and epoll have no FD_SETSIZE limit; see -socketevents
+#if defined(__linux__)
+#define USE_POLL
+#include <poll.h>
+#endif
+#if defined(USE_POLL) && defined(HAVE_SYS_EPOLL_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef WIN32
 #define MSG_DONTWAIT        0
 #else
@@ -104,7 +114,7 @@ size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -6,7 +6,9 @@
 #include <iostream>
 
 #include "arith_uint256.h"
+#include "clientversion.h"
 #include "mempool_limit.h"
+#include "streams.h"
 #include "utiltime.h"
 #include "utiltest.h"
 #include "transaction_builder.h"
@@ -53,6 +55,28 @@ TEST(MempoolLimitTests, RecentlyEvictedListDoesNotContainAfterExpiry)
     EXPECT_FALSE(recentlyEvicted.contains(TX_ID3));
 }
 
+TEST(MempoolLimitTests, RecentlyEvictedListSerializationKeepsTimes)
+{
+    SetMockTime(1);
+    RecentlyEvictedList recentlyEvicted(3, 2);
+    recentlyEvicted.add(TX_ID1);
+    SetMockTime(2);
+    recentlyEvicted.add(TX_ID2);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << recentlyEvicted;
+    RecentlyEvictedList restored(3, 2);
+    ss >> restored;
+    EXPECT_TRUE(restored.contains(TX_ID1));
+    EXPECT_TRUE(restored.contains(TX_ID2));
+    EXPECT_FALSE(restored.contains(TX_ID3));
+
+    // The original eviction times still apply after reloading
+    SetMockTime(4);
+    EXPECT_FALSE(restored.contains(TX_ID1));
+    EXPECT_TRUE(restored.contains(TX_ID2));
+}
+
 TEST(MempoolLimitTests, RecentlyEvictedDropOneAtATime)
 {
     SetMockTime(1);
@@ -236,5 +236,14 @@ public:
  *      .Finalize()
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+/** Optimized SipHash-2-4 implementation for uint256 followed by a little-endian
+ *  uint32_t, as used to hash outpoints. It is identical to:
+ *    SipHasher(k0, k1)
+ *      .Write(val.begin(), 32)
+ *      .Write((const unsigned char*)&extra, 4)
+ *      .Finalize()
+ *  on little-endian systems.
+ */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
 
 #endif // BITCOIN_HASH_H
@@ -9,6 +9,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -25,6 +26,7 @@
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
+#include "policy/fees.h"
 #include "policy/policy.h"
 #include "pow.h"
 #include "spork.h"
@@ -103,9 +105,21 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nTxSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+struct IteratorComparator
+{
+    template<typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+/** Serialized size of the orphans each peer has handed us, for -maxorphanbytesperpeer */
+map<NodeId, size_t> mapOrphanBytesByPeer GUARDED_BY(cs_main);
 map<uint256, int64_t> mapRejectedBlocks  GUARDED_BY(cs_main);;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
@@ -256,9 +270,13 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for compact block reconstruction.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /** Peers we asked to announce new blocks with "cmpctblock", oldest first. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
@@ -272,6 +290,24 @@ namespace {
     set<int> setDirtyFileInfo;
 } // anon namespace
 
+void CBlockDownloadRate::AddDelivery(int64_t nTimeRequested, int64_t nTimeReceived)
+{
+    int64_t nSample = std::max<int64_t>(nTimeReceived - std::max(nTimeRequested, nLastDeliveryTime), 1);
+    nLastDeliveryTime = nTimeReceived;
+    if (nAvgDeliveryMicros == 0)
+        nAvgDeliveryMicros = nSample;
+    else
+        nAvgDeliveryMicros = (7 * nAvgDeliveryMicros + nSample) / 8;
+    nInFlightLimit = std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER,
+        std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, BLOCK_DOWNLOAD_INFLIGHT_TARGET / nAvgDeliveryMicros));
+}
+
+int CBlockDownloadRate::GetDownloadWindow() const
+{
+    return std::min<int>(MAX_BLOCK_DOWNLOAD_WINDOW,
+        std::max<int>(BLOCK_DOWNLOAD_WINDOW, BLOCK_DOWNLOAD_WINDOW * nInFlightLimit / MAX_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -317,8 +353,20 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How fast this peer delivers requested blocks, and how many it may have in flight.
+    CBlockDownloadRate downloadRate;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can give us compact blocks ("sendcmpct" received).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced to it with "cmpctblock".
+    bool fPreferHeaderAndIDs;
+    //! The last header we sent this peer, in a "headers" message or as part of a "cmpctblock".
+    CBlockIndex *pindexBestHeaderSent;
+    //! Whether this peer wants new blocks announced with "headers" instead of "inv".
+    bool fPreferHeaders;
+    //! Number of consecutive announced headers that did not connect to our header tree.
+    int nUnconnectingHeaders;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -332,6 +380,11 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        pindexBestHeaderSent = NULL;
+        fPreferHeaders = false;
+        nUnconnectingHeaders = 0;
     }
 };
 
@@ -389,6 +442,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -411,10 +465,39 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Fold the time a peer took to deliver a block we asked it for into its
+// delivery rate.
+void UpdateBlockDownloadRate(NodeId nodeid, const uint256& hash, int64_t nTimeReceived) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    State(nodeid)->downloadRate.AddDelivery(itInFlight->second.second->nTime, nTimeReceived);
+}
+
+// Requires cs_main.
+// How many blocks may be in flight from a peer. In case when -graylist option
+// is used inbound connected peers are also asked for blocks. Multiple inbound
+// connected peers can share the same remote network connection, so let's
+// request fewer blocks from each of them.
+int GetBlocksInFlightLimit(const CNode* pnode, const CNodeState* state) {
+    int nLimit = state->downloadRate.GetInFlightLimit();
+    return pnode->fInbound ? std::max(1, nLimit / 4) : nLimit;
+}
+
+// Requires cs_main.
+// Returns false, still setting pit, if the block was already in flight from the same peer.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator *pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it's from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
@@ -426,6 +509,60 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+    return true;
+}
+
+// Requires cs_main.
+// Whether a peer with nothing in flight should take over the block another
+// peer is holding the download window back with. It must have delivered
+// blocks at least twice as fast as the holder, counting the time the holder
+// has already spent on its oldest request.
+bool IsFasterBlockSource(const CNodeState& state, const CNodeState& stallerState, const uint256& hash, int64_t nNow) {
+    int64_t nAvgMicros = state.downloadRate.GetAvgDeliveryMicros();
+    if (nAvgMicros == 0)
+        return false;
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::const_iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end())
+        return false;
+    int64_t nStallerMicros = std::max(stallerState.downloadRate.GetAvgDeliveryMicros(), nNow - stallerState.vBlocksInFlight.front().nTime);
+    return nNow - itInFlight->second.second->nTime > 2 * nAvgMicros &&
+        2 * nAvgMicros < nStallerMicros;
+}
+
+/** Whether our tip is recent enough to fetch announced blocks directly instead of waiting for the download window. */
+bool CanDirectFetch(const Consensus::Params& consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetTime() - consensusParams.PoWTargetSpacing(chainActive.Height()) * 20;
+}
+
+/**
+ * Ask a peer that just gave us a new tip to announce the next blocks with
+ * "cmpctblock", keeping at most MAX_CMPCTBLOCK_HB_PEERS such peers and
+ * dropping the one we picked longest ago. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom)
+{
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (NodeId id : lNodesAnnouncingHeaderAndIDs)
+        if (id == pfrom->GetId())
+            return;
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        NodeId idOldest = lNodesAnnouncingHeaderAndIDs.front();
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->GetId() == idOldest) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -443,6 +580,16 @@ void ProcessBlockAvailability(NodeId nodeid) {
     }
 }
 
+/** Whether the peer is known to have this header, because it announced it or we sent it. Requires cs_main. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
 /** Update tracking information about which blocks a peer is assumed to have. */
 void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     CNodeState *state = State(nodeid);
@@ -482,7 +629,7 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalling) {
     if (count == 0)
         return;
 
@@ -515,9 +662,10 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + state->downloadRate.GetDownloadWindow();
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -549,6 +697,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalling = pindexWaitingFor;
                     }
                     return;
                 }
@@ -559,6 +708,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -646,31 +796,41 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    std::pair<map<uint256, COrphanTx>::iterator, bool> ret = mapOrphanTransactions.insert(
+        std::make_pair(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, sz}));
+    assert(ret.second);
     for (const CTxIn& txin : tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
+    mapOrphanBytesByPeer[peer] += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u peerbytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), mapOrphanBytesByPeer[peer]);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
-        return;
+        return 0;
     for (const CTxIn& txin : it->second.tx.vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
+        itPrev->second.erase(it);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, size_t>::iterator itBytes = mapOrphanBytesByPeer.find(it->second.fromPeer);
+    if (itBytes != mapOrphanBytesByPeer.end()) {
+        assert(itBytes->second >= it->second.nTxSize);
+        itBytes->second -= it->second.nTxSize;
+        if (itBytes->second == 0)
+            mapOrphanBytesByPeer.erase(itBytes);
+    }
     mapOrphanTransactions.erase(it);
+    return 1;
 }
 
 void EraseOrphansFor(NodeId peer)
@@ -682,17 +842,60 @@ void EraseOrphansFor(NodeId peer)
         map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
         if (maybeErase->second.fromPeer == peer)
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
+            nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
         }
     }
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytesPerPeer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                nErased += EraseOrphanTx(maybeErase->first);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweeping again before the earliest remaining entry could expire is pointless
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+        nEvicted += nErased;
+    }
+
+    // A single peer may not hold more than its share of orphan memory;
+    // evict its oldest orphans first so the others keep theirs.
+    std::vector<NodeId> vOverLimit;
+    for (const std::pair<const NodeId, size_t>& entry : mapOrphanBytesByPeer)
+        if (entry.second > nMaxOrphanBytesPerPeer)
+            vOverLimit.push_back(entry.first);
+    for (NodeId peer : vOverLimit)
+    {
+        map<NodeId, size_t>::iterator itBytes;
+        while ((itBytes = mapOrphanBytesByPeer.find(peer)) != mapOrphanBytesByPeer.end() &&
+               itBytes->second > nMaxOrphanBytesPerPeer)
+        {
+            map<uint256, COrphanTx>::iterator itOldest = mapOrphanTransactions.end();
+            for (map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+                if (it->second.fromPeer == peer &&
+                    (itOldest == mapOrphanTransactions.end() || it->second.nTimeExpire < itOldest->second.nTimeExpire))
+                    itOldest = it;
+            assert(itOldest != mapOrphanTransactions.end());
+            nEvicted += EraseOrphanTx(itOldest->first);
+        }
+    }
+
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
         // Evict a random orphan:
@@ -706,6 +909,78 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/**
+ * Queue the orphans that spend an output of tx for reconsideration.
+ */
+void static QueueOrphansSpending(const CTransaction& tx, std::set<uint256>& setOrphanWork) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const uint256& hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (const map<uint256, COrphanTx>::iterator& mi : itByPrev->second)
+            setOrphanWork.insert(mi->first);
+    }
+}
+
+/**
+ * Reconsider queued orphans until one of them is accepted to, or rejected
+ * from, the mempool. A chain of dependants is thereby resolved one
+ * transaction per message handler pass instead of in a single cs_main
+ * critical section. Returns true if work is left in setOrphanWork.
+ */
+bool static ProcessOrphanTx(const CChainParams& chainparams, std::set<uint256>& setOrphanWork) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    AssertLockHeld(cs_main);
+    while (!setOrphanWork.empty())
+    {
+        const uint256 orphanHash = *setOrphanWork.begin();
+        setOrphanWork.erase(setOrphanWork.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransaction orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            QueueOrphansSpending(orphanTx, setOrphanWork);
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+    }
+    return !setOrphanWork.empty();
+}
+
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
     if (tx.nLockTime == 0)
@@ -1132,15 +1407,11 @@ int GetInputAge(CTxIn& vin)
 
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 {
-    int sigs = 0;
     int nResult = GetInputAge(vin);
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()) {
-            sigs = (*i).second.CountSignatures();
-        }
+        int sigs = txLockManager.GetSignatures(nTXHash);
         if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
             return nSwiftTXDepth + nResult;
         }
@@ -1151,12 +1422,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 
 int GetIXConfirmations(uint256 nTXHash)
 {
-    int sigs = 0;
-
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()) {
-        sigs = (*i).second.CountSignatures();
-    }
+    int sigs = txLockManager.GetSignatures(nTXHash);
     if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
         return nSwiftTXDepth;
     }
@@ -1452,7 +1718,7 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(const CChainParams& chainparams,CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectAbsurdFee, bool ignoreFees)
+bool AcceptToMemoryPool(const CChainParams& chainparams,CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectAbsurdFee, bool ignoreFees, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1620,7 +1886,7 @@ bool AcceptToMemoryPool(const CChainParams& chainparams,CTxMemPool& pool, CValid
         // We don't yet know if the transaction commits to consensusBranchId,
         // but if the entry gets added to the mempool, then it has passed
         // ContextualCheckInputs and therefore this is correct.
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Before zcashd 4.2.0, we had a condition here to always accept a tx if it contained
@@ -1685,6 +1951,18 @@ bool AcceptToMemoryPool(const CChainParams& chainparams,CTxMemPool& pool, CValid
             return state.Error("AcceptToMemoryPool: " + errmsg);
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1712,7 +1990,7 @@ bool AcceptToMemoryPool(const CChainParams& chainparams,CTxMemPool& pool, CValid
             LOCK(pool.cs);
 
             // Store transaction in memory
-            pool.addUnchecked(hash, entry, !IsInitialBlockDownload(chainparams.GetConsensus()));
+            pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload(chainparams.GetConsensus()));
 
             // Add memory address index
             if (fAddressIndex) {
@@ -1825,14 +2103,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- instantX transaction scanning -----------
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return state.DoS(0,
-                                 error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                                 REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLock;
+    if (txLockManager.HasConflictingLock(tx, hashLock)) {
+        return state.DoS(0,
+                         error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+                         REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -2124,6 +2399,50 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // Start at the index header WriteBlockToDisk put in front of the block
+    CDiskBlockPos hpos = pos;
+    hpos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: Block of %u bytes exceeds MAX_BLOCK_SIZE at %s", __func__, nSize, pos.ToString());
+
+        vBlock.resize(nSize);
+        filein.read((char*)vBlock.data(), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    // The serialized header is a prefix of the block, so its hash can be
+    // checked without decoding the transactions
+    size_t nHeaderSize = CBlockHeader::HEADER_SIZE;
+    try {
+        CDataStream ssSolution((const char*)vBlock.data() + std::min(nHeaderSize, vBlock.size()),
+                               (const char*)vBlock.data() + std::min(nHeaderSize + 9, vBlock.size()), SER_DISK, CLIENT_VERSION);
+        uint64_t nSolutionSize = ReadCompactSize(ssSolution);
+        nHeaderSize += GetSizeOfCompactSize(nSolutionSize) + nSolutionSize;
+    }
+    catch (const std::exception&) {
+        return error("%s: Malformed block header at %s", __func__, pos.ToString());
+    }
+    if (nHeaderSize > vBlock.size() || Hash(vBlock.begin(), vBlock.begin() + nHeaderSize) != hash)
+        return error("%s: Block header does not match %s at %s", __func__, hash.ToString(), pos.ToString());
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 12500 * COIN;
@@ -3470,6 +3789,122 @@ void PruneAndFlush() {
     FlushStateToDisk(Params(), state, FLUSH_STATE_NONE);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Number of transactions admitted per cs_main acquisition when loading mempool.dat */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 100;
+
+void DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        std::vector<uint256> vtxid;
+        mempool.queryHashesByAncestorScore(vtxid);
+        vinfo.reserve(vtxid.size());
+        for (const uint256& hash : vtxid) {
+            CTxMemPool::txiter it = mempool.mapTx.find(hash);
+            vinfo.push_back(std::make_pair(it->GetTx(), it->GetTime()));
+        }
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat.new", "wb");
+        if (!filestr) {
+            LogPrintf("%s: failed to open mempool.dat.new for writing\n", __func__);
+            return;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        mempool.WriteRecentlyEvicted(file);
+        file << (uint64_t)vinfo.size();
+        for (const std::pair<CTransaction, int64_t>& i : vinfo) {
+            file << i.first;
+            file << i.second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid-nStart)*0.000001, (nLast-nMid)*0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+    }
+}
+
+bool LoadMempool(const CChainParams& chainparams)
+{
+    FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat", "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t count = 0;
+    int64_t failed = 0;
+    int64_t already_there = 0;
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return false;
+        }
+
+        // Apply the deltas first, so that prioritised transactions are
+        // admitted with their modified fees.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (const std::pair<uint256, std::pair<double, CAmount> >& i : mapDeltas) {
+            mempool.PrioritiseTransaction(i.first, i.first.ToString(), i.second.first, i.second.second);
+        }
+        mempool.ReadRecentlyEvicted(file);
+
+        // Transactions were dumped in descending ancestor fee rate order, so
+        // if the pool fills up it is the cheapest ones that are left out.
+        uint64_t num;
+        file >> num;
+        while (num) {
+            LOCK(cs_main);
+            for (unsigned int i = 0; num && i < MEMPOOL_LOAD_BATCH_SIZE; i++, num--) {
+                CTransaction tx;
+                int64_t nTime;
+                file >> tx;
+                file >> nTime;
+
+                if (mempool.exists(tx.GetHash())) {
+                    ++already_there;
+                    continue;
+                }
+                CValidationState state;
+                if (AcceptToMemoryPool(chainparams, mempool, state, tx, false, NULL, false, false, nTime)) {
+                    ++count;
+                } else {
+                    ++failed;
+                }
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i already there\n", count, failed, already_there);
+    return true;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
@@ -3905,9 +4340,11 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
     do {
         boost::this_thread::interruption_point();
 
+        const CBlockIndex *pindexFork;
         bool fInitialDownload;
         {
             LOCK(cs_main);
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -3918,6 +4355,7 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = chainActive.FindFork(pindexOldTip);
             fInitialDownload = IsInitialBlockDownload(chainparams.GetConsensus());
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -3927,15 +4365,52 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
         uiInterface.NotifyBlockTip(fInitialDownload, pindexNewTip);
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Find the hashes of all blocks that weren't previously in the best chain.
+            std::vector<uint256> vHashes;
+            CBlockIndex *pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
             {
-                LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                // Peers in high-bandwidth compact block mode get the block
+                // itself as a "cmpctblock" instead of an announcement.
+                std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CInv inv(MSG_BLOCK, hashNewTip);
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (nodestate != NULL && nodestate->fPreferHeaderAndIDs && vHashes.size() == 1 &&
+                            !pnode->HasInventoryKnown(inv) && !PeerHasHeader(nodestate, pindexNewTip) &&
+                            PeerHasHeader(nodestate, pindexNewTip->pprev)) {
+                        if (!pcmpctblock) {
+                            CBlock blockNewTip;
+                            if (pblock && pblock->GetHash() == hashNewTip)
+                                blockNewTip = *pblock;
+                            else if (!ReadBlockFromDisk(blockNewTip, pindexNewTip, chainparams.GetConsensus()))
+                                assert(!"cannot load block from disk");
+                            pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(blockNewTip));
+                        }
+                        pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        pnode->AddInventoryKnown(inv);
+                        nodestate->pindexBestHeaderSent = pindexNewTip;
+                        continue;
+                    }
+                    // Announced as "headers" or "inv" by SendMessages.
+                    for (const uint256& hash : reverse_iterate(vHashes))
+                        pnode->PushBlockHash(hash);
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4365,15 +4840,12 @@ bool CheckBlock(const CBlock& block,
         for (const CTransaction& tx : block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
-                for (const CTxIn& in : tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 hashLock;
+                if (txLockManager.HasConflictingLock(tx, hashLock)) {
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLock.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                        REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -5387,6 +5859,7 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanBytesByPeer.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -5795,10 +6268,9 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
     case MSG_TXLOCK_REQUEST:
-        return mapTxLockReq.count(inv.hash) ||
-               mapTxLockReqRejected.count(inv.hash);
+        return txLockManager.HaveTxLockRequest(inv.hash);
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        return txLockManager.HaveTxLockVote(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -5844,6 +6316,112 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * Messages run on several message handler threads at once. The masternode,
+ * budget, spork, swiftTX and obfuscation handlers, and most of the core ones,
+ * were written for a single handler thread, so they run with this held; take
+ * it before cs_main, never after.
+ */
+static CCriticalSection cs_serialMessages;
+
+/** Messages whose handlers only touch the sending peer, or lock what they share themselves */
+static bool IsConcurrentMessage(const std::string& strCommand)
+{
+    return strCommand == "getdata" || strCommand == "ping" || strCommand == "pong" ||
+        strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear" ||
+        strCommand == "feefilter" || strCommand == "notfound" || strCommand == "reject";
+}
+
+/** Masternode gossip whose signatures can be recovered before the handler runs */
+static bool IsSignedGossipMessage(const std::string& strCommand)
+{
+    return strCommand == "mnb" || strCommand == "mnp" || strCommand == "mnw" ||
+        strCommand == "mvote" || strCommand == "fbvote" || strCommand == "txlvote";
+}
+
+static CCheckQueue<CGossipSignatureCheck> gossipcheckqueue(16);
+/** Only one message handler thread may drive gossipcheckqueue at a time */
+static CCriticalSection cs_gossipCheckQueue;
+
+void ThreadGossipSignatureCheck() {
+    RenameThread(strprintf("%s-gossipch", COIN_NICKNAME).c_str());
+    gossipcheckqueue.Thread();
+}
+
+template <typename T>
+static void AddGossipSignatureCheck(const CDataStream& vRecv, std::vector<CGossipSignatureCheck>& vChecks)
+{
+    CDataStream ss(vRecv);
+    T obj;
+    ss >> obj;
+    vChecks.push_back(CGossipSignatureCheck(obj.GetSignatureMessage(), obj.vchSig));
+}
+
+static void AddGossipSignatureChecks(const std::string& strCommand, const CDataStream& vRecv, std::vector<CGossipSignatureCheck>& vChecks)
+{
+    try {
+        if (strCommand == "mnb") {
+            CDataStream ss(vRecv);
+            CMasternodeBroadcast mnb;
+            ss >> mnb;
+            vChecks.push_back(CGossipSignatureCheck(mnb.GetSignatureMessage(), mnb.sig));
+            if (mnb.lastPing != CMasternodePing())
+                vChecks.push_back(CGossipSignatureCheck(mnb.lastPing.GetSignatureMessage(), mnb.lastPing.vchSig));
+        } else if (strCommand == "mnp") {
+            AddGossipSignatureCheck<CMasternodePing>(vRecv, vChecks);
+        } else if (strCommand == "mnw") {
+            AddGossipSignatureCheck<CMasternodePaymentWinner>(vRecv, vChecks);
+        } else if (strCommand == "mvote") {
+            AddGossipSignatureCheck<CBudgetVote>(vRecv, vChecks);
+        } else if (strCommand == "fbvote") {
+            AddGossipSignatureCheck<CFinalizedBudgetVote>(vRecv, vChecks);
+        } else if (strCommand == "txlvote") {
+            CDataStream ss(vRecv);
+            CConsensusVote vote;
+            ss >> vote;
+            vChecks.push_back(CGossipSignatureCheck(vote.GetSignatureMessage(), vote.vchMasterNodeSignature));
+        }
+    } catch (const std::exception&) {
+        // Malformed; the handler rejects it when it gets there
+    }
+}
+
+/**
+ * Recover the signers of the masternode gossip queued from pfrom on the
+ * gossip check threads, so the handlers, which run under cs_serialMessages,
+ * find them in the signer cache instead of doing the EC work serially.
+ */
+// requires LOCK(pfrom->cs_vRecvMsg)
+static void PrecheckGossipSignatures(CNode* pfrom)
+{
+    std::vector<CGossipSignatureCheck> vChecks;
+    unsigned int nMessages = 0;
+    for (CNetMessage& msg : pfrom->vRecvMsg) {
+        if (!msg.complete() || nMessages >= MAX_GOSSIP_PRECHECK_MESSAGES)
+            break;
+        if (msg.fPrechecked)
+            continue;
+        msg.fPrechecked = true;
+        std::string strCommand = msg.hdr.GetCommand();
+        if (!IsSignedGossipMessage(strCommand))
+            continue;
+        AddGossipSignatureChecks(strCommand, msg.vRecv, vChecks);
+        nMessages++;
+    }
+
+    if (vChecks.size() > 1 && nScriptCheckThreads) {
+        TRY_LOCK(cs_gossipCheckQueue, lockQueue);
+        if (lockQueue) {
+            CCheckQueueControl<CGossipSignatureCheck> control(&gossipcheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+            return;
+        }
+    }
+    for (CGossipSignatureCheck& check : vChecks)
+        check();
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     int currentHeight = GetHeight();
@@ -5852,8 +6430,6 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -5868,53 +6444,86 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                // Decide under cs_main, but read and send the block without
+                // it, so serving old blocks to syncing peers does not stall
+                // validation and the other message handler threads.
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                bool fCompact = false;
+                CBlockIndex* pindex = NULL;
+                CDiskBlockPos blockPos;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = mi->second;
+                        if (chainActive.Contains(pindex)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = pindex->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && CNode::OutboundTargetReached(consensusParams.PoWTargetSpacing(currentHeight), true) && (
+                            (
+                                (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > nOneWeek)
+                            ) || inv.type == MSG_FILTERED_BLOCK
+                        ) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (pindex->nStatus & BLOCK_HAVE_DATA)) {
+                        blockPos = pindex->GetBlockPos();
+                        // A peer asking for an old block is unlikely to have a
+                        // mempool that matches it, so send it in full instead.
+                        fCompact = inv.type == MSG_CMPCT_BLOCK && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    } else {
+                        send = false;
+                    }
                 }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(consensusParams.PoWTargetSpacing(currentHeight), true) && (
-                        (
-                            (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)
-                        ) || inv.type == MSG_FILTERED_BLOCK
-                    ) && !pfrom->fWhitelisted)
+                // Send block from disk. A full block goes out as the bytes we
+                // stored; only compact and filtered blocks need decoding.
+                bool fRaw = inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact);
+                CBlock block;
+                std::vector<unsigned char> vRawBlock;
+                if (send)
                 {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
-
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                    bool fRead = fRaw ? ReadRawBlockFromDisk(vRawBlock, blockPos, inv.hash, Params().MessageStart())
+                                      : ReadBlockFromDisk(block, blockPos, consensusParams) && block.GetHash() == inv.hash;
+                    if (!fRead) {
+                        // The block may have been pruned since we looked it up
+                        LOCK(cs_main);
+                        if (pindex->nStatus & BLOCK_HAVE_DATA)
+                            assert(!"cannot load block from disk");
+                        send = false;
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    if (fRaw)
+                        pfrom->PushMessage("block", CFlatData(vRawBlock));
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -5930,7 +6539,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->HasInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5944,7 +6553,10 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        {
+                            LOCK(cs_main);
+                            vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        }
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -5952,6 +6564,8 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             }
             else if (inv.IsKnownType())
             {
+                LOCK2(cs_serialMessages, cs_main);
+
                 // Check the mempool to see if a transaction is expiring soon.  If so, do not send to peer.
                 // Note that a transaction enters the mempool first, before the serialized form is cached
                 // in mapRelay after a successful relay.
@@ -5983,19 +6597,21 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         }
 	                }
 	                if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-	                    if (mapTxLockVote.count(inv.hash)) {
+	                    CConsensusVote vote;
+	                    if (txLockManager.GetTxLockVote(inv.hash, vote)) {
 	                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
 	                        ss.reserve(1000);
-	                        ss << mapTxLockVote[inv.hash];
+	                        ss << vote;
 	                        pfrom->PushMessage("txlvote", ss);
 	                        pushed = true;
 	                    }
 	                }
 	                if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-	                    if (mapTxLockReq.count(inv.hash)) {
+	                    CTransaction txLockReq;
+	                    if (txLockManager.GetTxLockRequest(inv.hash, txLockReq)) {
 	                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
 	                        ss.reserve(1000);
-	                        ss << mapTxLockReq[inv.hash];
+	                        ss << txLockReq;
 	                        pfrom->PushMessage("ix", ss);
 	                        pushed = true;
 	                    }
@@ -6099,7 +6715,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -6118,6 +6734,38 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/**
+ * Hand a block that was received in full, or rebuilt from a compact block, to
+ * validation. A peer that gave us a new tip this way is asked to announce
+ * the next blocks with "cmpctblock".
+ */
+void static ProcessBlockFromPeer(const CChainParams& chainparams, CNode* pfrom, const string& strCommand, CBlock& block, bool fForceProcessing)
+{
+    const uint256 hash = block.GetHash();
+    bool fNewBlock;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        fNewBlock = mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA);
+    }
+
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else if (fNewBlock) {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == hash && !IsInitialBlockDownload(chainparams.GetConsensus()))
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+    }
+}
+
 bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -6276,6 +6924,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
+        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -6290,6 +6939,33 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we understand compact blocks, but don't ask it to
+        // push them to us yet; peers that predate them ignore the message.
+        pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+
+        // Ask the peer to announce new blocks with "headers" (BIP 130).
+        pfrom->PushMessage("sendheaders");
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -6418,7 +7094,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
                     CNodeState *nodestate = State(pfrom->GetId());
 
                     if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().PoWTargetSpacing(pindexBestHeader->nHeight) * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        nodestate->nBlocksInFlight < GetBlocksInFlightLimit(pfrom, nodestate)) {
                         vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
@@ -6451,6 +7127,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message getdata size() = %u", vInv.size());
         }
@@ -6548,14 +7225,18 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        CNodeState *nodestate = State(pfrom->GetId());
+        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
 
     else if ((strCommand == "tx" || strCommand == "dstx") && !IsInitialBlockDownload(chainparams.GetConsensus()))
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -6619,66 +7300,16 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+            QueueOrphansSpending(tx, pfrom->setOrphanWork);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+            // Start on the orphans that depended on this one; any that are
+            // left are picked up by ProcessMessages on later passes.
+            ProcessOrphanTx(chainparams, pfrom->setOrphanWork);
         }
         // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
         else if (fMissingInputs &&
@@ -6690,7 +7321,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanBytesPerPeer = (size_t)std::max((int64_t)0, GetArg("-maxorphanbytesperpeer", DEFAULT_MAX_ORPHAN_BYTES_PER_PEER));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytesPerPeer);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else {
@@ -6757,6 +7389,35 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // If this looks like it could be a block announcement (nCount <
+        // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
+        // don't connect:
+        // - Send a getheaders message in response to try to connect the chain.
+        // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+        //   don't connect before giving DoS points
+        // - Once a headers message is received that is valid and does connect,
+        //   nUnconnectingHeaders gets reset back to 0.
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount < MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                    headers[0].GetHash().ToString(),
+                    headers[0].hashPrevBlock.ToString(),
+                    pindexBestHeader->nHeight,
+                    pfrom->id, nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
+                Misbehaving(pfrom->GetId(), 20);
+            }
+            return true;
+        }
+
         // If we already know the last header in the message, then it contains
         // no new information for us.  In this case, we do not request
         // more headers later.  This prevents multiple chains of redundant
@@ -6786,6 +7447,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0) {
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -6802,6 +7468,56 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // If this set of headers is valid and ends in a block with at least as
+        // much work as our tip, download as much as possible right away rather
+        // than waiting for SendMessages to schedule it.
+        if (pindexLast && CanDirectFetch(chainparams.GetConsensus()) && pindexLast->IsValid(BLOCK_VALID_TREE) &&
+                chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            int nMaxInFlight = GetBlocksInFlightLimit(pfrom, nodestate);
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (unsigned int)nMaxInFlight) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen.  Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                        pindexLast->GetBlockHash().ToString(),
+                        pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                for (CBlockIndex *pindex : reverse_iterate(vToFetch)) {
+                    if (nodestate->nBlocksInFlight >= nMaxInFlight) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    // The block that extends our tip can usually be rebuilt
+                    // from our mempool, so ask for it in compact form.
+                    bool fCompact = nodestate->fProvidesHeaderAndIDs && pindex->pprev == chainActive.Tip();
+                    vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n",
+                            pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                            pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                if (vGetData.size() > 0)
+                    pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
         CheckBlockIndex(chainparams.GetConsensus());
     }
 
@@ -6815,23 +7531,209 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams.GetConsensus());
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        {
+            LOCK(cs_main);
+            UpdateBlockDownloadRate(pfrom->GetId(), inv.hash, nTimeReceived);
+        }
+        ProcessBlockFromPeer(chainparams, pfrom, strCommand, block, forceProcessing);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+                if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
+            assert(pindex);
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block for some reason, but our mempool will probably be useless
+                    // so we just grab the block via normal getdata
+                    pfrom->PushMessage("getdata", std::vector<CInv>(1, inv));
+                }
+                return true;
+            }
+
+            // If we're not close to tip yet, give up and let parallel block fetch work its magic
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            // Blocks further ahead than this can't be rebuilt from our mempool
+            // anyway; the header is recorded and the regular download logic
+            // fetches the block.
+            if (pindex->nHeight > chainActive.Height() + 2) {
+                if (fAlreadyInFlight)
+                    pfrom->PushMessage("getdata", std::vector<CInv>(1, inv));
+                return true;
+            }
+
+            CNodeState *nodestate = State(pfrom->GetId());
+            if (!((!fAlreadyInFlight && nodestate->nBlocksInFlight < GetBlocksInFlightLimit(pfrom, nodestate)) ||
+                  (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())))
+                return true;
+
+            list<QueuedBlock>::iterator queuedBlockIt;
+            MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt);
+            if (queuedBlockIt->partialBlock) {
+                // The block was already in flight using compact blocks from the same peer
+                LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                return true;
+            }
+            queuedBlockIt->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+
+            PartiallyDownloadedBlock& partialBlock = *queuedBlockIt->partialBlock;
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Duplicate txindexes, the block is now in-flight, so just request it
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, inv));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = pindex->GetBlockHash();
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            // Everything was in our mempool
+            status = partialBlock.FillBlock(block, std::vector<CTransaction>());
+            if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, inv));
+                return true;
             }
+            fBlockReconstructed = (status == READ_STATUS_OK);
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(chainparams, pfrom, strCommand, block, true);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Answer requests for old blocks with the full block: repeated
+            // getblocktxn must not be a cheap way to trigger disk reads.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
         }
 
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            } else {
+                fBlockRead = true;
+            }
+        }
+
+        if (fBlockRead)
+            ProcessBlockFromPeer(chainparams, pfrom, strCommand, block, true);
     }
 
 
@@ -6850,7 +7752,10 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr)
@@ -6870,6 +7775,12 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
         LOCK2(cs_main, pfrom->cs_filter);
 
+        CAmount filterrate = 0;
+        {
+            LOCK(pfrom->cs_feeFilter);
+            filterrate = pfrom->minFeeFilter;
+        }
+
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
@@ -6879,6 +7790,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             if (fInMemPool && IsExpiringSoonTx(tx, currentHeight + 1)) {
                 continue;
             }
+            if (filterrate) {
+                CFeeRate feeRate;
+                if (mempool.lookupFeeRate(hash, feeRate) && feeRate.GetFeePerK() < filterrate)
+                    continue;
+            }
 
             CInv inv(MSG_TX, hash);
             if (pfrom->pfilter) {
@@ -6982,12 +7898,12 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        if (!pfrom->alertKnown.contains(alertHash))
         {
             if (alert.ProcessAlert(chainparams.AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                pfrom->alertKnown.insert(alertHash);
                 {
                     LOCK(cs_vNodes);
                     for (CNode* pnode : vNodes)
@@ -7012,6 +7928,7 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
                strCommand == "filteradd"))
     {
         if (pfrom->nVersion >= NO_BLOOM_VERSION) {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return false;
         } else if (GetBoolArg("-enforcenodebloom", DEFAULT_ENFORCENODEBLOOM)) {
@@ -7027,8 +7944,11 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         vRecv >> filter;
 
         if (!filter.IsWithinSizeConstraints())
+        {
             // There is no excuse for sending a too-large filter
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
+        }
         else
         {
             LOCK(pfrom->cs_filter);
@@ -7047,15 +7967,22 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
         // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
         // and thus, the maximum size any matched object can have) in a filteradd message
+        bool fBad = false;
         if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
         {
-            Misbehaving(pfrom->GetId(), 100);
+            fBad = true;
         } else {
             LOCK(pfrom->cs_filter);
             if (pfrom->pfilter)
                 pfrom->pfilter->insert(vData);
             else
-                Misbehaving(pfrom->GetId(), 100);
+                fBad = true;
+        }
+        if (fBad)
+        {
+            // not under cs_filter, which is taken after cs_main
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 100);
         }
     }
 
@@ -7071,6 +7998,20 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     }
 
 
+    else if (strCommand == "feefilter")
+    {
+        CAmount newFeeFilter = 0;
+        vRecv >> newFeeFilter;
+        if (MoneyRange(newFeeFilter)) {
+            {
+                LOCK(pfrom->cs_feeFilter);
+                pfrom->minFeeFilter = newFeeFilter;
+            }
+            LogPrint("net", "received: feefilter of %s from peer=%d\n", CFeeRate(newFeeFilter).ToString(), pfrom->id);
+        }
+    }
+
+
     else if (strCommand == "reject")
     {
         if (fDebug) {
@@ -7147,6 +8088,14 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    if (!pfrom->setOrphanWork.empty()) {
+        // Finish reconsidering the orphans this peer's transactions made
+        // connectable before handling anything else it sent.
+        LOCK2(cs_serialMessages, cs_main);
+        if (ProcessOrphanTx(chainparams, pfrom->setOrphanWork))
+            return fOk;
+    }
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -7189,8 +8138,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -7198,11 +8147,20 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
             continue;
         }
 
+        if (!msg.fPrechecked && IsSignedGossipMessage(strCommand))
+            PrecheckGossipSignatures(pfrom);
+
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
-            fRet = ProcessMessage(chainparams, pfrom, strCommand, vRecv, msg.nTime);
+            if (IsConcurrentMessage(strCommand)) {
+                fRet = ProcessMessage(chainparams, pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_serialMessages);
+                fRet = ProcessMessage(chainparams, pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -7232,6 +8190,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordMsgProcessed(strCommand, GetTimeMicros() - nProcessStart, nProcessStart - msg.nTime);
+
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -7294,8 +8254,10 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
             for (CNode* pnode : vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrSend);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -7309,6 +8271,7 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_addrSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -7382,18 +8345,126 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                for (const uint256 &hash : pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other, e.g. after invalidateblock /
+                        // reconsiderblock on the tip added a block twice.
+                        // Robustly deal with this rare situation by reverting
+                        // to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // filterInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            } else if (!vHeaders.empty()) {
+                if (vHeaders.size() > 1) {
+                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                            vHeaders.size(),
+                            vHeaders.front().GetHash().ToString(),
+                            vHeaders.back().GetHash().ToString(), pto->id);
+                } else {
+                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                }
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
         vector<CInv> vInv;
         vector<CInv> vInvWait;
+        CAmount filterrate = 0;
+        {
+            LOCK(pto->cs_feeFilter);
+            filterrate = pto->minFeeFilter;
+        }
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             for (const CInv& inv : pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                uint256 key = CNode::InventoryKey(inv);
+                if (pto->filterInventoryKnown.contains(key))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -7414,9 +8485,17 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // Don't announce transactions the peer has told us it would not accept
+                if (inv.type == MSG_TX && filterrate) {
+                    CFeeRate feeRate;
+                    if (mempool.lookupFeeRate(inv.hash, feeRate) && feeRate.GetFeePerK() < filterrate)
+                        continue;
+                }
+
+                // Skip duplicates queued since the check above
+                if (!pto->filterInventoryKnown.contains(key))
                 {
+                    pto->filterInventoryKnown.insert(key);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -7466,21 +8545,32 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        // In case when -graylist option is used inbound connected peers are also asked for blocks. Multiple inbound connected peers can share the same remote network connection, so let's request fewer blocks from each of them ...
-        int customMaxBlocksInTransitPerPeer = pto->fInbound ? (MAX_BLOCKS_IN_TRANSIT_PER_PEER / 4) : MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        int customMaxBlocksInTransitPerPeer = GetBlocksInFlightLimit(pto, &state);
         if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(params)) && state.nBlocksInFlight < customMaxBlocksInTransitPerPeer) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), customMaxBlocksInTransitPerPeer - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexStalling = NULL;
+            FindNextBlocksToDownload(pto->GetId(), customMaxBlocksInTransitPerPeer - state.nBlocksInFlight, vToDownload, staller, pindexStalling);
             for (CBlockIndex *pindex : vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // The block that extends our tip can usually be rebuilt
+                // from our mempool, so ask for it in compact form.
+                bool fCompact = state.fProvidesHeaderAndIDs && pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload(params);
+                vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), params, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState* stallerState = State(staller);
+                if (pindexStalling && IsFasterBlockSource(state, *stallerState, pindexStalling->GetBlockHash(), nNow)) {
+                    // Rather than sit idle behind a slower peer, fetch the block holding
+                    // the window back ourselves. This takes it off the staller's queue.
+                    LogPrint("net", "Re-requesting block %s (%d) from peer=%d, stalled at peer=%d\n",
+                        pindexStalling->GetBlockHash().ToString(), pindexStalling->nHeight, pto->id, staller);
+                    vGetData.push_back(CInv(MSG_BLOCK, pindexStalling->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalling->GetBlockHash(), params, pindexStalling);
+                } else if (stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -7511,6 +8601,34 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: feefilter
+        //
+        // Peers that do not know the message ignore it, so it is sent without
+        // a protocol version bump (PROTOCOL_VERSION gates masternode payments).
+        if (!pto->fDisconnect && GetBoolArg("-feefilter", DEFAULT_FEEFILTER)) {
+            CAmount currentFilter = mempool.GetMinFee().GetFeePerK();
+            int64_t timeNow = GetTimeMicros();
+            if (timeNow > pto->nextSendTimeFeeFilter) {
+                static CFeeRate default_feerate(DEFAULT_MIN_RELAY_TX_FEE);
+                static FeeFilterRounder filterRounder(default_feerate);
+                CAmount filterToSend = filterRounder.round(currentFilter);
+                // If we don't allow free transactions, then we always have a fee filter of at least minRelayTxFee
+                if (GetArg("-limitfreerelay", DEFAULT_LIMITFREERELAY) <= 0)
+                    filterToSend = std::max(filterToSend, ::minRelayTxFee.GetFeePerK());
+                if (filterToSend != pto->lastSentFeeFilter) {
+                    pto->PushMessage("feefilter", filterToSend);
+                    pto->lastSentFeeFilter = filterToSend;
+                }
+                pto->nextSendTimeFeeFilter = PoissonNextSend(timeNow, AVG_FEEFILTER_BROADCAST_INTERVAL);
+            }
+            // If the fee filter has changed substantially and it's still more than MAX_FEEFILTER_CHANGE_DELAY
+            // until scheduled broadcast, then move the broadcast to within MAX_FEEFILTER_CHANGE_DELAY.
+            else if (timeNow + MAX_FEEFILTER_CHANGE_DELAY * 1000000 < pto->nextSendTimeFeeFilter &&
+                     (currentFilter < 3 * pto->lastSentFeeFilter / 4 || currentFilter > 4 * pto->lastSentFeeFilter / 3)) {
+                pto->nextSendTimeFeeFilter = timeNow + GetRandInt(MAX_FEEFILTER_CHANGE_DELAY) * 1000000;
+            }
+        }
     }
     return true;
 }
@@ -7535,6 +8653,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanBytesByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
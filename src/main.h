@@ -71,6 +71,12 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanbytesperpeer, maximum serialized size of the orphan transactions kept for a single peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_BYTES_PER_PEER = 100000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_PRE_BLOSSOM_TX_EXPIRY_DELTA = 20;
 static const unsigned int DEFAULT_POST_BLOSSOM_TX_EXPIRY_DELTA = DEFAULT_PRE_BLOSSOM_TX_EXPIRY_DELTA * Consensus::BLOSSOM_POW_TARGET_SPACING_RATIO;
@@ -87,8 +93,13 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its delivery rate is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the per-peer in-flight limit once it adapts to the peer's measured delivery rate. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Keep about this much (in microseconds) of a peer's measured block delivery time in flight. */
+static const int64_t BLOCK_DOWNLOAD_INFLIGHT_TARGET = 2 * 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -97,8 +108,16 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+ *  harder). A peer allowed more than MAX_BLOCKS_IN_TRANSIT_PER_PEER blocks in flight gets a
+ *  proportionally larger window, up to MAX_BLOCK_DOWNLOAD_WINDOW. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 4 * BLOCK_DOWNLOAD_WINDOW;
+/** Maximum number of queued masternode gossip messages of one peer whose signatures are checked in one batch */
+static const unsigned int MAX_GOSSIP_PRECHECK_MESSAGES = 128;
+/** Maximum number of headers to announce when relaying blocks with headers message.*/
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of unconnecting headers announcements before DoS score */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -110,6 +129,24 @@ static const unsigned int WITNESS_WRITE_UPDATES = 10000;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const unsigned int DEFAULT_LIMITFREERELAY = 15;
+/** Default for -feefilter, whether to tell peers our mempool minimum fee */
+static const bool DEFAULT_FEEFILTER = true;
+/** Average delay between feefilter broadcasts in seconds. */
+static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
+/** Maximum feefilter broadcast delay after significant change. */
+static const unsigned int MAX_FEEFILTER_CHANGE_DELAY = 5 * 60;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 100;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 900;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 1000;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 2500;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** How often, in seconds, the mempool is dumped to mempool.dat while running */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
 static const bool DEFAULT_RELAYPRIORITY = false;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 
@@ -257,6 +294,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
 bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the masternode gossip signature checking thread */
+void ThreadGossipSignatureCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload(const Consensus::Params& params);
 /** Format a string that describes several potential problems detected by the core */
@@ -300,11 +339,15 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/** Dump the mempool to disk. */
+void DumpMempool();
+/** Load the mempool from disk. */
+bool LoadMempool(const CChainParams& chainparams);
 
 int ActiveProtocol();
 
-/** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(const CChainParams& chainparams, CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool ignoreFees = false);
+/** (try to) add transaction to memory pool; nAcceptTime overrides the entry time when non-zero **/
+bool AcceptToMemoryPool(const CChainParams& chainparams, CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool ignoreFees = false, int64_t nAcceptTime = 0);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -323,6 +366,35 @@ struct CNodeStateStats {
     std::vector<int> vHeightInFlight;
 };
 
+/**
+ * How fast a peer delivers the blocks we request from it. Its in-flight limit
+ * is sized to keep about BLOCK_DOWNLOAD_INFLIGHT_TARGET of deliveries queued,
+ * and its download window scales with that limit.
+ */
+class CBlockDownloadRate
+{
+private:
+    //! How many blocks may be in flight from this peer, adapted to nAvgDeliveryMicros.
+    int nInFlightLimit;
+    //! Moving average of the time this peer takes per requested block (in microseconds), or 0 if unknown.
+    int64_t nAvgDeliveryMicros;
+    //! When the last block we requested from this peer arrived (in microseconds).
+    int64_t nLastDeliveryTime;
+
+public:
+    CBlockDownloadRate() : nInFlightLimit(MAX_BLOCKS_IN_TRANSIT_PER_PEER), nAvgDeliveryMicros(0), nLastDeliveryTime(0) {}
+
+    /** Fold in a block requested at nTimeRequested that arrived at nTimeReceived. While
+     *  requests are pipelined the sample is the gap since the previous block, so it
+     *  tracks throughput; for a lone request it is the round trip. */
+    void AddDelivery(int64_t nTimeRequested, int64_t nTimeReceived);
+
+    int GetInFlightLimit() const { return nInFlightLimit; }
+    int64_t GetAvgDeliveryMicros() const { return nAvgDeliveryMicros; }
+    /** How far beyond the last common block to fetch from this peer */
+    int GetDownloadWindow() const;
+};
+
 
 
 CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree);
@@ -460,6 +532,8 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the serialized block stored at pos, checking only that its header hashes to hash */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
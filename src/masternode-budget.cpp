@@ -14,7 +14,6 @@
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "util.h"
-#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include "key_io.h"
@@ -249,155 +248,189 @@ void CBudgetManager::SubmitFinalBudget()
 // CBudgetDB
 //
 
-CBudgetDB::CBudgetDB()
-{
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
-}
+CBudgetDB budgetDB;
+
+enum {
+    // 1 held the whole manager in earlier versions of the file, and 2 to 5 the
+    // seen votes, which are dropped on load anyway; they are skipped
+    RECORD_BUDGET_STATE = 6,
+    RECORD_PROPOSAL = 7,
+    RECORD_PROPOSAL_ERASED = 8,
+    RECORD_PROPOSAL_VOTE = 9,
+    RECORD_PROPOSAL_VOTE_ERASED = 10,
+    RECORD_FINALIZED_BUDGET = 11,
+    RECORD_FINALIZED_BUDGET_ERASED = 12,
+    RECORD_FINALIZED_BUDGET_VOTE = 13,
+    RECORD_FINALIZED_BUDGET_VOTE_ERASED = 14
+};
 
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
+// A proposal or finalized budget as logged; its votes are records of their own
+template <typename T>
+class CBudgetRecord : public T
 {
-    LOCK(objToSave.cs);
-
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
+public:
+    explicit CBudgetRecord(const T& obj) : T(obj) { this->mapVotes.clear(); }
+};
 
-    return true;
+CBudgetDB::CBudgetDB() : log("budget.dat", "MasternodeBudget"), nStateSize(0), fLoaded(false)
+{
 }
 
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
+template <typename Stream, typename Operation>
+void CBudgetDB::StateSerializationOp(CBudgetManager& obj, Stream& s, Operation ser_action)
 {
-    LOCK(objToLoad.cs);
-
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
+    READWRITE(obj.mapOrphanMasternodeBudgetVotes);
+    READWRITE(obj.mapOrphanFinalizedBudgetVotes);
+}
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
+bool CBudgetDB::Write(const CBudgetManager& objToSave)
+{
+    LOCK(cs);
+    // don't log the entries that are still to be read as erased
+    if (!fLoaded) return false;
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
+    {
+        CBudgetManager& obj = const_cast<CBudgetManager&>(objToSave);
+        LOCK(obj.cs);
+
+        CDataStream ssState(SER_DISK, CLIENT_VERSION);
+        StateSerializationOp(obj, ssState, CSerActionSerialize());
+        uint256 hash = Hash(ssState.begin(), ssState.end());
+
+        std::map<uint256, const CBudgetVote*> mapProposalVotes;
+        for (std::pair<const uint256, CBudgetProposal>& proposal : obj.mapProposals)
+            for (std::pair<const uint256, CBudgetVote>& vote : proposal.second.mapVotes)
+                mapProposalVotes[vote.second.GetHash()] = &vote.second;
+        std::map<uint256, const CFinalizedBudgetVote*> mapFinalizedVotes;
+        for (std::pair<const uint256, CFinalizedBudget>& finalizedBudget : obj.mapFinalizedBudgets)
+            for (std::pair<const uint256, CFinalizedBudgetVote>& vote : finalizedBudget.second.mapVotes)
+                mapFinalizedVotes[vote.second.GetHash()] = &vote.second;
+
+        if (log.NeedsRewrite(nStateSize + indexProposals.GetLiveSize() + indexProposalVotes.GetLiveSize() +
+                             indexFinalizedBudgets.GetLiveSize() + indexFinalizedVotes.GetLiveSize())) {
+            log.Reset();
+            log.Append(RECORD_BUDGET_STATE, ssState);
+            indexProposals.AppendAllAs<CBudgetRecord<CBudgetProposal> >(log, RECORD_PROPOSAL, obj.mapProposals);
+            indexProposalVotes.AppendAll(log, RECORD_PROPOSAL_VOTE, mapProposalVotes);
+            indexFinalizedBudgets.AppendAllAs<CBudgetRecord<CFinalizedBudget> >(log, RECORD_FINALIZED_BUDGET, obj.mapFinalizedBudgets);
+            indexFinalizedVotes.AppendAll(log, RECORD_FINALIZED_BUDGET_VOTE, mapFinalizedVotes);
+        } else {
+            if (hash != hashState)
+                log.Append(RECORD_BUDGET_STATE, ssState);
+            indexProposals.AppendChangesAs<CBudgetRecord<CBudgetProposal> >(log, RECORD_PROPOSAL, RECORD_PROPOSAL_ERASED, obj.mapProposals);
+            indexProposalVotes.AppendChanges(log, RECORD_PROPOSAL_VOTE, RECORD_PROPOSAL_VOTE_ERASED, mapProposalVotes);
+            indexFinalizedBudgets.AppendChangesAs<CBudgetRecord<CFinalizedBudget> >(log, RECORD_FINALIZED_BUDGET, RECORD_FINALIZED_BUDGET_ERASED, obj.mapFinalizedBudgets);
+            indexFinalizedVotes.AppendChanges(log, RECORD_FINALIZED_BUDGET_VOTE, RECORD_FINALIZED_BUDGET_VOTE_ERASED, mapFinalizedVotes);
         }
+        hashState = hash;
+        nStateSize = ssState.size();
+    }
 
+    return log.Flush();
+}
 
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
+CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad)
+{
+    LOCK(cs);
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
+    indexProposals.Clear();
+    indexProposalVotes.Clear();
+    indexFinalizedBudgets.Clear();
+    indexFinalizedVotes.Clear();
+    hashState.SetNull();
+    nStateSize = 0;
+    fLoaded = true;
+
+    CBudgetManager objLoaded;
+    std::map<uint256, CBudgetVote> mapProposalVotes;
+    std::map<uint256, CFinalizedBudgetVote> mapFinalizedVotes;
+    CRecordLog::ReadResult result = log.Replay([&](unsigned char nType, CDataStream& ssRecord) {
+        if (nType == RECORD_BUDGET_STATE) {
+            hashState = Hash(ssRecord.begin(), ssRecord.end());
+            nStateSize = ssRecord.size();
+            StateSerializationOp(objLoaded, ssRecord, CSerActionUnserialize());
+        } else if (nType == RECORD_PROPOSAL) {
+            std::pair<uint256, CBudgetProposal> proposal;
+            ssRecord >> proposal;
+            objLoaded.mapProposals.erase(proposal.first);
+            objLoaded.mapProposals.insert(proposal);
+            indexProposals.Logged(proposal.first, proposal.second);
+        } else if (nType == RECORD_PROPOSAL_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            objLoaded.mapProposals.erase(hash);
+            indexProposals.Erased(hash);
+        } else if (nType == RECORD_PROPOSAL_VOTE) {
+            std::pair<uint256, CBudgetVote> vote;
+            ssRecord >> vote;
+            mapProposalVotes[vote.first] = vote.second;
+            indexProposalVotes.Logged(vote.first, vote.second);
+        } else if (nType == RECORD_PROPOSAL_VOTE_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mapProposalVotes.erase(hash);
+            indexProposalVotes.Erased(hash);
+        } else if (nType == RECORD_FINALIZED_BUDGET) {
+            std::pair<uint256, CFinalizedBudget> finalizedBudget;
+            ssRecord >> finalizedBudget;
+            objLoaded.mapFinalizedBudgets.erase(finalizedBudget.first);
+            objLoaded.mapFinalizedBudgets.insert(finalizedBudget);
+            indexFinalizedBudgets.Logged(finalizedBudget.first, finalizedBudget.second);
+        } else if (nType == RECORD_FINALIZED_BUDGET_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            objLoaded.mapFinalizedBudgets.erase(hash);
+            indexFinalizedBudgets.Erased(hash);
+        } else if (nType == RECORD_FINALIZED_BUDGET_VOTE) {
+            std::pair<uint256, CFinalizedBudgetVote> vote;
+            ssRecord >> vote;
+            mapFinalizedVotes[vote.first] = vote.second;
+            indexFinalizedVotes.Logged(vote.first, vote.second);
+        } else if (nType == RECORD_FINALIZED_BUDGET_VOTE_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mapFinalizedVotes.erase(hash);
+            indexFinalizedVotes.Erased(hash);
+        }
+    });
+    if (result == CRecordLog::FileError) return FileError;
+    if (result == CRecordLog::IncorrectMagicMessage) return IncorrectMagicMessage;
+    if (result == CRecordLog::IncorrectMagicNumber) return IncorrectMagicNumber;
 
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    {
+        // entries that arrived while the file was read are newer, keep those;
+        // AddOrUpdateVote in turn only takes votes newer than the ones it has
+        LOCK(objToLoad.cs);
+        std::string strError;
+        objToLoad.mapProposals.insert(objLoaded.mapProposals.begin(), objLoaded.mapProposals.end());
+        for (std::pair<const uint256, CBudgetVote>& vote : mapProposalVotes) {
+            std::map<uint256, CBudgetProposal>::iterator it = objToLoad.mapProposals.find(vote.second.nProposalHash);
+            if (it != objToLoad.mapProposals.end())
+                it->second.AddOrUpdateVote(vote.second, strError);
+        }
+        objToLoad.mapFinalizedBudgets.insert(objLoaded.mapFinalizedBudgets.begin(), objLoaded.mapFinalizedBudgets.end());
+        for (std::pair<const uint256, CFinalizedBudgetVote>& vote : mapFinalizedVotes) {
+            std::map<uint256, CFinalizedBudget>::iterator it = objToLoad.mapFinalizedBudgets.find(vote.second.nBudgetHash);
+            if (it != objToLoad.mapFinalizedBudgets.end())
+                it->second.AddOrUpdateVote(vote.second, strError);
+        }
+        objToLoad.mapOrphanMasternodeBudgetVotes.insert(objLoaded.mapOrphanMasternodeBudgetVotes.begin(), objLoaded.mapOrphanMasternodeBudgetVotes.end());
+        objToLoad.mapOrphanFinalizedBudgetVotes.insert(objLoaded.mapOrphanFinalizedBudgetVotes.begin(), objLoaded.mapOrphanFinalizedBudgetVotes.end());
+        objToLoad.InvalidateBudgetCache();
     }
 
-    LogPrint("masternode","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrint("masternode","Budget manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
+    LogPrint("masternode","Budget manager - cleaning....\n");
+    objToLoad.CheckAndRemove();
+    LogPrint("masternode","Budget manager - result:\n");
+    LogPrint("masternode","  %s\n", objToLoad.ToString());
 
     return Ok;
 }
 
 void DumpBudgets()
 {
-    int64_t nStart = GetTimeMillis();
-
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrint("masternode","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError) {
-        LogPrint("masternode","Missing budgets file - budget.dat, will try to recreate\n");
-    } else if (readResult != CBudgetDB::Ok) {
-        LogPrint("masternode","Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat) {
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        } else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
-
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    budgetDB.Write(budget);
 }
 
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
@@ -427,6 +460,7 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    InvalidateBudgetCache();
     LogPrint("masternode","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
     return true;
 }
@@ -466,7 +500,10 @@ void CBudgetManager::CheckAndRemove()
     std::map<uint256, CBudgetProposal>::iterator it2 = mapProposals.begin();
     while (it2 != mapProposals.end()) {
         CBudgetProposal* pbudgetProposal = &((*it2).second);
+        bool fWasValid = pbudgetProposal->fValid;
         pbudgetProposal->fValid = pbudgetProposal->IsValid(strError);
+        if (pbudgetProposal->fValid != fWasValid)
+            InvalidateBudgetCache();
         if (!strError.empty ()) {
             LogPrint("masternode","CBudgetManager::CheckAndRemove - Invalid budget proposal - %s\n", strError);
             strError = "";
@@ -658,8 +695,6 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
-
         CBudgetProposal* pbudgetProposal = &((*it).second);
         vBudgetProposalRet.push_back(pbudgetProposal);
 
@@ -686,13 +721,25 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
 {
     LOCK(cs);
 
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if (pindexPrev == NULL) return std::vector<CBudgetProposal*>();
+
+    int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
+    int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
+    int nThreshold = mnodeman.CountEnabled(ActiveProtocol()) / 10;
+
+    // The tallies only move with votes, so the ranking from the last call
+    // holds until a vote, a proposal or the cycle changes
+    if (nCachedBudgetBlockStart == nBlockStart && nCachedBudgetThreshold == nThreshold && GetTime() <= nCachedBudgetExpires)
+        return vCachedBudget;
+
     // ------- Sort budgets by Yes Count
 
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
+    vBudgetPorposalsSort.reserve(mapProposals.size());
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
         vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
         ++it;
     }
@@ -704,28 +751,25 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
 
     CAmount nBudgetAllocated = 0;
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (pindexPrev == NULL) return vBudgetProposalsRet;
-
-    int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
-    int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
-
+    int64_t nExpires = std::numeric_limits<int64_t>::max();
 
     std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
     while (it2 != vBudgetPorposalsSort.end()) {
         CBudgetProposal* pbudgetProposal = (*it2).first;
 
+        if (!pbudgetProposal->IsEstablished())
+            nExpires = std::min(nExpires, pbudgetProposal->GetEstablishedTime());
         LogPrint("masternode","CBudgetManager::GetBudget() - Processing Budget %s\n", pbudgetProposal->strProposalName.c_str());
         //prop start/end should be inside this period
         if (pbudgetProposal->fValid && pbudgetProposal->nBlockStart <= nBlockStart &&
             pbudgetProposal->nBlockEnd >= nBlockEnd &&
-            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > mnodeman.CountEnabled(ActiveProtocol()) / 10 &&
+            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > nThreshold &&
             pbudgetProposal->IsEstablished()) {
 
             LogPrint("masternode","CBudgetManager::GetBudget() -   Check 1 passed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nThreshold,
                       pbudgetProposal->IsEstablished());
 
             if (pbudgetProposal->GetAmount() + nBudgetAllocated <= nTotalBudget) {
@@ -741,13 +785,18 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         else {
             LogPrint("masternode","CBudgetManager::GetBudget() -   Check 1 failed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nThreshold,
                       pbudgetProposal->IsEstablished());
         }
 
         ++it2;
     }
 
+    vCachedBudget = vBudgetProposalsRet;
+    nCachedBudgetBlockStart = nBlockStart;
+    nCachedBudgetThreshold = nThreshold;
+    nCachedBudgetExpires = nExpires;
+
     return vBudgetProposalsRet;
 }
 
@@ -875,7 +924,8 @@ void CBudgetManager::NewBlock()
     LogPrint("masternode","CBudgetManager::NewBlock - mapProposals cleanup - size: %d\n", mapProposals.size());
     std::map<uint256, CBudgetProposal>::iterator it2 = mapProposals.begin();
     while (it2 != mapProposals.end()) {
-        (*it2).second.CleanAndRemove(false);
+        if ((*it2).second.CleanAndRemove(false))
+            InvalidateBudgetCache();
         ++it2;
     }
 
@@ -1294,7 +1344,11 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError))
+        return false;
+
+    InvalidateBudgetCache();
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1330,6 +1384,9 @@ CBudgetProposal::CBudgetProposal()
     nBlockEnd = 0;
     nAmount = 0;
     nTime = 0;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
     fValid = true;
 }
 
@@ -1342,6 +1399,9 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     address = addressIn;
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
     fValid = true;
 }
 
@@ -1356,6 +1416,9 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nTime = other.nTime;
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
+    nYeas = other.nYeas;
+    nNays = other.nNays;
+    nAbstains = other.nAbstains;
     fValid = true;
 }
 
@@ -1463,19 +1526,53 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
+    if (mapVotes.count(hash))
+        AddToTally(mapVotes[hash], -1);
     mapVotes[hash] = vote;
+    AddToTally(vote, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
 }
 
 // If masternode voted for a proposal, but is now invalid -- remove the vote
-void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
+bool CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
+    bool fChanged = false;
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
+        bool fValidVote = (*it).second.SignatureValid(fSignatureCheck);
+        if ((*it).second.fValid != fValidVote) {
+            AddToTally((*it).second, -1);
+            (*it).second.fValid = fValidVote;
+            AddToTally((*it).second, 1);
+            fChanged = true;
+        }
+        ++it;
+    }
+
+    return fChanged;
+}
+
+void CBudgetProposal::AddToTally(const CBudgetVote& vote, int nDelta)
+{
+    if (!vote.fValid) return;
+
+    if (vote.nVote == VOTE_YES) nYeas += nDelta;
+    else if (vote.nVote == VOTE_NO) nNays += nDelta;
+    else if (vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
+}
+
+void CBudgetProposal::RecountVotes()
+{
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
+
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+    while (it != mapVotes.end()) {
+        AddToTally((*it).second, 1);
         ++it;
     }
 }
@@ -1500,41 +1597,17 @@ double CBudgetProposal::GetRatio()
 
 int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nYeas;
 }
 
 int CBudgetProposal::GetNays()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nNays;
 }
 
 int CBudgetProposal::GetAbstains()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1634,6 +1707,11 @@ void CBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CBudgetVote::GetSignatureMessage()
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -1641,7 +1719,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1659,7 +1737,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2078,6 +2156,11 @@ void CFinalizedBudgetVote::Relay()
     RelayInv(inv);
 }
 
+std::string CFinalizedBudgetVote::GetSignatureMessage()
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     // Choose coins to use
@@ -2085,7 +2168,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2104,7 +2187,7 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -13,6 +13,7 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "recordlog.h"
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
@@ -66,6 +67,7 @@ public:
     CBudgetVote();
     CBudgetVote(CTxIn vin, uint256 nProposalHash, int nVoteIn);
 
+    std::string GetSignatureMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
@@ -118,6 +120,7 @@ public:
     CFinalizedBudgetVote();
     CFinalizedBudgetVote(CTxIn vinIn, uint256 nBudgetHashIn);
 
+    std::string GetSignatureMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
@@ -144,12 +147,27 @@ public:
 };
 
 /** Save Budget Manager (budget.dat)
+ *
+ * The file is a CRecordLog holding the seen budget and finalized budget
+ * votes, one record each, and the rest of the manager as a state record
+ * that is appended again when it changes.
  */
 class CBudgetDB
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    CCriticalSection cs;
+    CRecordLog log;
+    CRecordLogIndex indexProposals;
+    CRecordLogIndex indexProposalVotes;
+    CRecordLogIndex indexFinalizedBudgets;
+    CRecordLogIndex indexFinalizedVotes;
+    uint256 hashState;
+    uint64_t nStateSize;
+    // Read has run, so the log and the indexes match the manager
+    bool fLoaded;
+
+    template <typename Stream, typename Operation>
+    static void StateSerializationOp(CBudgetManager& obj, Stream& s, Operation ser_action);
 
 public:
     enum ReadResult {
@@ -163,10 +181,14 @@ public:
     };
 
     CBudgetDB();
+    /// Append the entries and the state that changed since the last write; does nothing before Read
     bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+    /// Add what the file holds to the manager, keeping the entries it already has
+    ReadResult Read(CBudgetManager& objToLoad);
 };
 
+extern CBudgetDB budgetDB;
+
 
 //
 // Budget Manager : Contains all proposals for the budget
@@ -178,6 +200,19 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // GetBudget's ranked proposals for the payment cycle starting at
+    // nCachedBudgetBlockStart (-1 when there is none); dropped when votes,
+    // proposals or their validity change
+    std::vector<CBudgetProposal*> vCachedBudget;
+    int nCachedBudgetBlockStart;
+    int nCachedBudgetThreshold;
+    // when a proposal left out for being too new becomes established
+    int64_t nCachedBudgetExpires;
+
+    void InvalidateBudgetCache() { nCachedBudgetBlockStart = -1; }
+
+    friend class CBudgetDB;
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -197,6 +232,7 @@ public:
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
+        InvalidateBudgetCache();
     }
 
     void ClearSeen()
@@ -244,6 +280,7 @@ public:
         LOCK(cs);
 
         LogPrintf("Budget object cleared\n");
+        InvalidateBudgetCache();
         mapProposals.clear();
         mapFinalizedBudgets.clear();
         mapSeenMasternodeBudgetProposals.clear();
@@ -269,6 +306,8 @@ public:
         READWRITE(mapOrphanMasternodeBudgetVotes);
         READWRITE(mapOrphanFinalizedBudgetVotes);
 
+        if (ser_action.ForRead())
+            InvalidateBudgetCache();
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
     }
@@ -457,6 +496,15 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+protected:
+    // valid votes by outcome, kept in step with mapVotes
+    int nYeas;
+    int nNays;
+    int nAbstains;
+
+    void AddToTally(const CBudgetVote& vote, int nDelta);
+    void RecountVotes();
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -487,15 +535,17 @@ public:
 
     bool IsValid(std::string& strError, bool fCheckCollateral = true);
 
-    bool IsEstablished()
+    int64_t GetEstablishedTime()
     {
         // Proposals must be at least a day old to make it into a budget
-        if (ChainNameFromCommandLine() == CBaseChainParams::MAIN) return (nTime < GetTime() - (60 * 60 * 24));
+        if (ChainNameFromCommandLine() == CBaseChainParams::MAIN) return nTime + (60 * 60 * 24);
 
         // For testing purposes - 5 minutes
-        return (nTime < GetTime() - (60 * 5));
+        return nTime + (60 * 5);
     }
 
+    bool IsEstablished() { return GetEstablishedTime() < GetTime(); }
+
     std::string GetName() { return strProposalName; }
     std::string GetURL() { return strURL; }
     int GetBlockStart() { return nBlockStart; }
@@ -514,7 +564,8 @@ public:
     void SetAllotted(CAmount nAllotedIn) { nAlloted = nAllotedIn; }
     CAmount GetAllotted() { return nAlloted; }
 
-    void CleanAndRemove(bool fSignatureCheck);
+    /// Revalidate the votes, returns true if the tallies changed
+    bool CleanAndRemove(bool fSignatureCheck);
 
     uint256 GetHash()
     {
@@ -548,6 +599,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -576,6 +629,9 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.nYeas, second.nYeas);
+        swap(first.nNays, second.nNays);
+        swap(first.nAbstains, second.nAbstains);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
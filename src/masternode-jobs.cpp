@@ -0,0 +1,187 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-jobs.h"
+#include "activemasternode.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
+#include "masternode-sync.h"
+#include "masternodeman.h"
+#include "obfuscation.h"
+#include "random.h"
+#include "scheduler.h"
+#include "swifttx.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/bind/bind.hpp>
+
+CMasternodeJobs masternodeJobs;
+
+CMasternodeJob::CMasternodeJob(const std::string& strNameIn, std::function<void()> funcIn, int64_t nIntervalIn, int64_t nMaxJitterIn, bool fNeedsBlockchainSyncIn) :
+    strName(strNameIn), func(funcIn), nInterval(nIntervalIn), nMaxJitter(nMaxJitterIn), fNeedsBlockchainSync(fNeedsBlockchainSyncIn), fTriggered(false),
+    nRuns(0), nTriggeredRuns(0), nTimeTotal(0), nTimeMax(0), nTimeLast(0), nLastRun(0)
+{
+}
+
+CMasternodeJobs::CMasternodeJobs() : pscheduler(NULL), fWasBlockchainSynced(false)
+{
+}
+
+void CMasternodeJobs::Start(CScheduler& scheduler)
+{
+    // read the caches off the init thread; the scheduler runs one task at a
+    // time, so the jobs below only get to run once they are loaded
+    scheduler.schedule(boost::bind(&CMasternodeJobs::LoadCaches, this), boost::chrono::system_clock::now());
+
+    if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
+
+    {
+        LOCK(cs);
+        assert(pscheduler == NULL);
+        pscheduler = &scheduler;
+
+        // in MasternodeJobId order
+        vJobs.push_back(CMasternodeJob("mnsync", boost::bind(&CMasternodeJobs::ProcessSync, this), MASTERNODE_SYNC_TIMEOUT, 0, false));
+        vJobs.push_back(CMasternodeJob("mnstatus", [] { activeMasternode.ManageStatus(); }, MASTERNODE_PING_SECONDS, 30 * 1000, true));
+        vJobs.push_back(CMasternodeJob("mnlist", [] {
+            mnodeman.CheckAndRemove();
+            mnodeman.ProcessMasternodeConnections();
+        }, 60, 10 * 1000, true));
+        vJobs.push_back(CMasternodeJob("mnpayments", [] { masternodePayments.CleanPaymentList(); }, 60, 10 * 1000, true));
+        vJobs.push_back(CMasternodeJob("swifttx", [] { txLockManager.CheckAndRemove(); }, 60, 10 * 1000, true));
+        vJobs.push_back(CMasternodeJob("obfuscation", [] {
+            obfuScationPool.CheckTimeout();
+            obfuScationPool.CheckForCompleteQueue();
+        }, 1, 0, true));
+        vJobs.push_back(CMasternodeJob("denominate", [] {
+            if (obfuScationPool.GetState() == POOL_STATUS_IDLE)
+                obfuScationPool.DoAutomaticDenominating();
+        }, 15, 2 * 1000, true));
+        // append what changed in the caches, so a crash loses only the last few seconds
+        vJobs.push_back(CMasternodeJob("mnflush", [] {
+            DumpMasternodes();
+            DumpBudgets();
+            DumpMasternodePayments();
+        }, MASTERNODES_FLUSH_SECONDS, 2 * 1000, false));
+        assert(vJobs.size() == MASTERNODE_JOB_FLUSH + 1);
+    }
+
+    for (int nJob = 0; nJob <= MASTERNODE_JOB_FLUSH; nJob++)
+        Schedule(nJob, vJobs[nJob].nInterval * 1000 + GetRand(vJobs[nJob].nMaxJitter + 1), true);
+}
+
+void CMasternodeJobs::Schedule(int nJob, int64_t nDelayMillis, bool fPeriodic)
+{
+    pscheduler->schedule(boost::bind(&CMasternodeJobs::Run, this, nJob, fPeriodic),
+        boost::chrono::system_clock::now() + boost::chrono::milliseconds(nDelayMillis));
+}
+
+void CMasternodeJobs::Trigger(int nJob)
+{
+    {
+        LOCK(cs);
+        if (pscheduler == NULL || vJobs[nJob].fTriggered) return;
+        vJobs[nJob].fTriggered = true;
+    }
+    Schedule(nJob, 0, false);
+}
+
+void CMasternodeJobs::Run(int nJob, bool fPeriodic)
+{
+    std::function<void()> func;
+    bool fRun;
+    {
+        LOCK(cs);
+        CMasternodeJob& job = vJobs[nJob];
+        if (!fPeriodic) job.fTriggered = false;
+        func = job.func;
+        fRun = !job.fNeedsBlockchainSync || masternodeSync.IsBlockchainSynced();
+    }
+
+    if (fRun) {
+        int64_t nStart = GetTimeMicros();
+        func();
+        int64_t nTime = GetTimeMicros() - nStart;
+
+        LOCK(cs);
+        CMasternodeJob& job = vJobs[nJob];
+        job.nRuns++;
+        if (!fPeriodic) job.nTriggeredRuns++;
+        job.nTimeTotal += nTime;
+        job.nTimeMax = std::max(job.nTimeMax, nTime);
+        job.nTimeLast = nTime;
+        job.nLastRun = GetTime();
+        LogPrint("bench", "  - Masternode job %s: %.2fms [%.2fms avg, %.2fms max]\n", job.strName,
+            nTime * 0.001, job.nTimeTotal * 0.001 / job.nRuns, job.nTimeMax * 0.001);
+    }
+
+    if (fPeriodic)
+        Schedule(nJob, vJobs[nJob].nInterval * 1000 + GetRand(vJobs[nJob].nMaxJitter + 1), true);
+}
+
+void CMasternodeJobs::LoadCaches()
+{
+    int64_t nStart = GetTimeMillis();
+
+    CMasternodeDB::ReadResult readResult = masternodeDB.Read(mnodeman);
+    if (readResult == CMasternodeDB::FileError)
+        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
+    else if (readResult != CMasternodeDB::Ok) {
+        LogPrintf("Error reading mncache.dat: ");
+        if (readResult == CMasternodeDB::IncorrectFormat)
+            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+        else
+            LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    }
+
+    CBudgetDB::ReadResult readResult2 = budgetDB.Read(budget);
+    if (readResult2 == CBudgetDB::FileError)
+        LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
+    else if (readResult2 != CBudgetDB::Ok) {
+        LogPrintf("Error reading budget.dat: ");
+        if (readResult2 == CBudgetDB::IncorrectFormat)
+            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+        else
+            LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    }
+
+    CMasternodePaymentDB::ReadResult readResult3 = masternodePaymentDB.Read(masternodePayments);
+    if (readResult3 == CMasternodePaymentDB::FileError)
+        LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
+    else if (readResult3 != CMasternodePaymentDB::Ok) {
+        LogPrintf("Error reading mnpayments.dat: ");
+        if (readResult3 == CMasternodePaymentDB::IncorrectFormat)
+            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+        else
+            LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    }
+
+    LogPrintf("Loaded masternode caches in %dms\n", GetTimeMillis() - nStart);
+}
+
+void CMasternodeJobs::ProcessSync()
+{
+    // try to sync from all available nodes, one step at a time
+    masternodeSync.Process();
+
+    // check if we should activate or ping, start right after sync is considered to be done
+    bool fSynced = masternodeSync.IsBlockchainSynced();
+    if (fSynced && !fWasBlockchainSynced)
+        Trigger(MASTERNODE_JOB_STATUS);
+    fWasBlockchainSynced = fSynced;
+}
+
+void CMasternodeJobs::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    // payment votes for blocks that are now too old can go right away
+    if (masternodeSync.IsBlockchainSynced())
+        Trigger(MASTERNODE_JOB_PAYMENTS);
+}
+
+std::vector<CMasternodeJob> CMasternodeJobs::GetJobs() const
+{
+    LOCK(cs);
+    return vJobs;
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MASTERNODE_JOBS_H
+#define MASTERNODE_JOBS_H
+
+#include "sync.h"
+#include "validationinterface.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class CBlockIndex;
+class CMasternodeJobs;
+class CScheduler;
+
+extern CMasternodeJobs masternodeJobs;
+
+enum MasternodeJobId {
+    MASTERNODE_JOB_SYNC,
+    MASTERNODE_JOB_STATUS,
+    MASTERNODE_JOB_LIST,
+    MASTERNODE_JOB_PAYMENTS,
+    MASTERNODE_JOB_SWIFTTX,
+    MASTERNODE_JOB_POOL,
+    MASTERNODE_JOB_DENOMINATE,
+    MASTERNODE_JOB_FLUSH
+};
+
+/** A periodic masternode or obfuscation maintenance task and its runtime stats */
+class CMasternodeJob
+{
+public:
+    std::string strName;
+    std::function<void()> func;
+    // seconds between periodic runs
+    int64_t nInterval;
+    // milliseconds a periodic run may be pushed back, so jobs drift apart
+    int64_t nMaxJitter;
+    // only run once masternodeSync.IsBlockchainSynced()
+    bool fNeedsBlockchainSync;
+    // a triggered run is queued
+    bool fTriggered;
+
+    uint64_t nRuns;
+    uint64_t nTriggeredRuns;
+    // microseconds spent in func
+    int64_t nTimeTotal;
+    int64_t nTimeMax;
+    int64_t nTimeLast;
+    int64_t nLastRun;
+
+    CMasternodeJob(const std::string& strNameIn, std::function<void()> funcIn, int64_t nIntervalIn, int64_t nMaxJitterIn, bool fNeedsBlockchainSyncIn);
+};
+
+/**
+ * Runs the masternode and obfuscation maintenance on the scheduler thread.
+ * Every job is scheduled on its own, with a random delay added to each run so
+ * the heavy ones don't land on the same second; jobs that depend on the chain
+ * or on the sync state are also triggered by those events.
+ */
+class CMasternodeJobs : public CValidationInterface
+{
+private:
+    // critical section to protect the inner data structures
+    mutable CCriticalSection cs;
+
+    std::vector<CMasternodeJob> vJobs;
+    CScheduler* pscheduler;
+    bool fWasBlockchainSynced;
+
+    void Schedule(int nJob, int64_t nDelayMillis, bool fPeriodic);
+    void Run(int nJob, bool fPeriodic);
+    void LoadCaches();
+    void ProcessSync();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+
+public:
+    CMasternodeJobs();
+
+    /// Load the masternode caches and schedule the jobs, all on the scheduler thread
+    void Start(CScheduler& scheduler);
+    /// Run a job as soon as the scheduler gets to it, unless a triggered run is already queued
+    void Trigger(int nJob);
+    std::vector<CMasternodeJob> GetJobs() const;
+};
+
+#endif
@@ -14,7 +14,6 @@
 #include "sync.h"
 #include "util.h"
 #include "utilmoneystr.h"
-#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include "key_io.h"
@@ -30,150 +29,79 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 // CMasternodePaymentDB
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
+CMasternodePaymentDB masternodePaymentDB;
+
+enum {
+    RECORD_PAYMENT_VOTE = 1,
+    RECORD_PAYMENT_VOTE_ERASED = 2
+};
+
+CMasternodePaymentDB::CMasternodePaymentDB() : log("mnpayments.dat", "MasternodePayments"), fLoaded(false)
 {
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
 }
 
 bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 {
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+    LOCK(cs);
+    // don't log the votes that are still to be read as erased
+    if (!fLoaded) return false;
 
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        if (log.NeedsRewrite(indexVotes.GetLiveSize())) {
+            log.Reset();
+            indexVotes.AppendAll(log, RECORD_PAYMENT_VOTE, objToSave.mapMasternodePayeeVotes);
+        } else {
+            indexVotes.AppendChanges(log, RECORD_PAYMENT_VOTE, RECORD_PAYMENT_VOTE_ERASED, objToSave.mapMasternodePayeeVotes);
+        }
     }
-    fileout.fclose();
 
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
+    return log.Flush();
 }
 
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
-{
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
+CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad)
+{
+    LOCK(cs);
+
+    indexVotes.Clear();
+    fLoaded = true;
+
+    std::map<uint256, CMasternodePaymentWinner> mapVotes;
+    CRecordLog::ReadResult result = log.Replay([&](unsigned char nType, CDataStream& ssRecord) {
+        if (nType == RECORD_PAYMENT_VOTE) {
+            std::pair<uint256, CMasternodePaymentWinner> vote;
+            ssRecord >> vote;
+            mapVotes[vote.first] = vote.second;
+            indexVotes.Logged(vote.first, vote.second);
+        } else if (nType == RECORD_PAYMENT_VOTE_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mapVotes.erase(hash);
+            indexVotes.Erased(hash);
         }
+    });
+    if (result == CRecordLog::FileError) return FileError;
+    if (result == CRecordLog::IncorrectMagicMessage) return IncorrectMagicMessage;
+    if (result == CRecordLog::IncorrectMagicNumber) return IncorrectMagicNumber;
 
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    {
+        // votes that arrived while the file was read are kept
+        LOCK(cs_mapMasternodePayeeVotes);
+        objToLoad.mapMasternodePayeeVotes.insert(mapVotes.begin(), mapVotes.end());
     }
-
-    LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+    objToLoad.RebuildBlockPayees();
+    LogPrint("masternode","  %s\n", objToLoad.ToString());
+    LogPrint("masternode","Masternode payments manager - cleaning....\n");
+    objToLoad.CleanPaymentList();
+    LogPrint("masternode","Masternode payments manager - result:\n");
     LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrint("masternode","Masternode payments manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
 
     return Ok;
 }
 
 void DumpMasternodePayments()
 {
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError) {
-        LogPrint("masternode","Missing budgets file - mnpayments.dat, will try to recreate\n");
-    } else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat) {
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        } else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
-
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    masternodePaymentDB.Write(masternodePayments);
 }
 
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue)
@@ -416,14 +344,19 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
     }
 }
 
+std::string CMasternodePaymentWinner::GetSignatureMessage()
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 {
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetSignatureMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         return false;
@@ -497,13 +430,60 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, 1);
+        if (blockPayees.HasPayeeWithVotes(winnerIn.payee, MNPAYMENTS_LASTPAID_MIN_VOTES))
+            mapPayeeHeights[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+void CMasternodePayments::RebuildPayeeIndex()
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_vecPayments);
+
+    mapPayeeHeights.clear();
+    for (std::pair<const int, CMasternodeBlockPayees>& item : mapMasternodeBlocks) {
+        for (CMasternodePayee& payee : item.second.vecPayments) {
+            if (payee.nVotes >= MNPAYMENTS_LASTPAID_MIN_VOTES)
+                mapPayeeHeights[payee.scriptPubKey].insert(item.first);
+        }
+    }
+}
+
+void CMasternodePayments::RebuildBlockPayees()
+{
+    {
+        LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+        mapMasternodeBlocks.clear();
+        for (std::pair<const uint256, CMasternodePaymentWinner>& item : mapMasternodePayeeVotes) {
+            const CMasternodePaymentWinner& winner = item.second;
+            if (!mapMasternodeBlocks.count(winner.nBlockHeight))
+                mapMasternodeBlocks[winner.nBlockHeight] = CMasternodeBlockPayees(winner.nBlockHeight);
+            mapMasternodeBlocks[winner.nBlockHeight].AddPayee(winner.payee, 1);
+        }
+    }
+
+    RebuildPayeeIndex();
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeeHeights.find(payee);
+    if (it == mapPayeeHeights.end()) return -1;
+
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nMaxHeight);
+    if (itHeight == it->second.begin()) return -1;
+    --itHeight;
+
+    return *itHeight >= nMinHeight ? *itHeight : -1;
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -645,9 +625,23 @@ void CMasternodePayments::CleanPaymentList()
 
         if (nHeight - winner.nBlockHeight > nLimit) {
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
+            {
+                LOCK(masternodeSync.cs);
+                masternodeSync.mapSeenSyncMNW.erase((*it).first);
+            }
             mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
+            std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.find(winner.nBlockHeight);
+            if (itBlock != mapMasternodeBlocks.end()) {
+                LOCK(cs_vecPayments);
+                for (CMasternodePayee& payee : itBlock->second.vecPayments) {
+                    std::map<CScript, std::set<int> >::iterator itPayee = mapPayeeHeights.find(payee.scriptPubKey);
+                    if (itPayee == mapPayeeHeights.end()) continue;
+                    itPayee->second.erase(winner.nBlockHeight);
+                    if (itPayee->second.empty())
+                        mapPayeeHeights.erase(itPayee);
+                }
+                mapMasternodeBlocks.erase(itBlock);
+            }
         } else {
             ++it;
         }
@@ -771,9 +765,7 @@ bool CMasternodePaymentWinner::SignatureValid()
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetSignatureMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
@@ -10,6 +10,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "recordlog.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,6 +27,8 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 3
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// votes a payee needs at a height before it counts as paid there
+#define MNPAYMENTS_LASTPAID_MIN_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -36,12 +39,18 @@ void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees);
 void DumpMasternodePayments();
 
 /** Save Masternode Payment Data (mnpayments.dat)
+ *
+ * The file is a CRecordLog of the payment votes; the block payees are
+ * rebuilt from the votes when it is read.
  */
 class CMasternodePaymentDB
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    CCriticalSection cs;
+    CRecordLog log;
+    CRecordLogIndex indexVotes;
+    // Read has run, so the log and the index match the votes
+    bool fLoaded;
 
 public:
     enum ReadResult {
@@ -55,10 +64,14 @@ public:
     };
 
     CMasternodePaymentDB();
+    /// Append the votes added or removed since the last write; does nothing before Read
     bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    /// Add the votes the file holds to the ones already known
+    ReadResult Read(CMasternodePayments& objToLoad);
 };
 
+extern CMasternodePaymentDB masternodePaymentDB;
+
 class CMasternodePayee
 {
 public:
@@ -193,6 +206,7 @@ public:
         return ss.GetHash();
     }
 
+    std::string GetSignatureMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
@@ -241,6 +255,8 @@ public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    // heights in mapMasternodeBlocks at which each payee has MNPAYMENTS_LASTPAID_MIN_VOTES votes
+    std::map<CScript, std::set<int> > mapPayeeHeights;
 
     CMasternodePayments()
     {
@@ -253,6 +269,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -262,6 +279,12 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
+    void RebuildPayeeIndex();
+    /// Recount mapMasternodeBlocks from mapMasternodePayeeVotes
+    void RebuildBlockPayees();
+    /// Most recent height in [nMinHeight, nMaxHeight] the payee was voted for, or -1
+    int GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight);
+
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
@@ -296,6 +319,8 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead())
+            RebuildPayeeIndex();
     }
 };
 
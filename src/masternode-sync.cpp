@@ -10,6 +10,7 @@
 #include "masternode-sync.h"
 #include "masternode-payments.h"
 #include "masternode-budget.h"
+#include "masternode-jobs.h"
 #include "masternode.h"
 #include "masternodeman.h"
 #include "spork.h"
@@ -22,11 +23,17 @@ CMasternodeSync masternodeSync;
 
 CMasternodeSync::CMasternodeSync()
 {
-    Reset();
+    Clear();
 }
 
 
 void CMasternodeSync::Reset()
+{
+    LOCK(cs);
+    Clear();
+}
+
+void CMasternodeSync::Clear()
 {
     lastMasternodeList = 0;
     lastMasternodeWinner = 0;
@@ -47,11 +54,19 @@ void CMasternodeSync::Reset()
     RequestedMasternodeAssets = MASTERNODE_SYNC_INITIAL;
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+    assetMasternodeList.SetNull();
+    assetMasternodeWinner.SetNull();
+    assetBudget.SetNull();
+    maxBudgetItemProp = 0;
+    maxBudgetItemFin = 0;
 }
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
 {
-    if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
+    bool fSeen = mnodeman.mapSeenMasternodeBroadcast.count(hash);
+
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncMNB[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeList = GetTime();
             mapSeenSyncMNB[hash]++;
@@ -59,12 +74,16 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
     } else {
         lastMasternodeList = GetTime();
         mapSeenSyncMNB.insert(make_pair(hash, 1));
+        CheckProgress(assetMasternodeList, mapSeenSyncMNB.size());
     }
 }
 
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
-    if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
+    bool fSeen = masternodePayments.mapMasternodePayeeVotes.count(hash);
+
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncMNW[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeWinner = GetTime();
             mapSeenSyncMNW[hash]++;
@@ -72,13 +91,17 @@ void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
     } else {
         lastMasternodeWinner = GetTime();
         mapSeenSyncMNW.insert(make_pair(hash, 1));
+        CheckProgress(assetMasternodeWinner, mapSeenSyncMNW.size());
     }
 }
 
 void CMasternodeSync::AddedBudgetItem(uint256 hash)
 {
-    if (budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
-        budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash)) {
+    bool fSeen = budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
+        budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash);
+
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncBudget[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastBudgetItem = GetTime();
             mapSeenSyncBudget[hash]++;
@@ -86,21 +109,25 @@ void CMasternodeSync::AddedBudgetItem(uint256 hash)
     } else {
         lastBudgetItem = GetTime();
         mapSeenSyncBudget.insert(make_pair(hash, 1));
+        CheckProgress(assetBudget, mapSeenSyncBudget.size());
     }
 }
 
 bool CMasternodeSync::IsBudgetPropEmpty()
 {
+    LOCK(cs);
     return sumBudgetItemProp == 0 && countBudgetItemProp > 0;
 }
 
 bool CMasternodeSync::IsBudgetFinEmpty()
 {
+    LOCK(cs);
     return sumBudgetItemFin == 0 && countBudgetItemFin > 0;
 }
 
 void CMasternodeSync::GetNextAsset()
 {
+    LOCK(cs);
     switch (RequestedMasternodeAssets) {
     case (MASTERNODE_SYNC_INITIAL):
     case (MASTERNODE_SYNC_FAILED): // should never be used here actually, use Reset() instead
@@ -158,6 +185,7 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
         int nCount;
         vRecv >> nItemID >> nCount;
 
+        LOCK(cs);
         if (RequestedMasternodeAssets >= MASTERNODE_SYNC_FINISHED) return;
 
         //this means we will receive no further communication
@@ -166,21 +194,31 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
             if (nItemID != RequestedMasternodeAssets) return;
             sumMasternodeList += nCount;
             countMasternodeList++;
+            assetMasternodeList.nMaxReported = std::max(assetMasternodeList.nMaxReported, nCount);
+            CheckProgress(assetMasternodeList, mapSeenSyncMNB.size());
             break;
         case (MASTERNODE_SYNC_MNW):
-            if (nItemID != RequestedMasternodeAssets) return;
+            // winners and budget are asked together
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_MNW) return;
             sumMasternodeWinner += nCount;
             countMasternodeWinner++;
+            assetMasternodeWinner.nMaxReported = std::max(assetMasternodeWinner.nMaxReported, nCount);
+            CheckProgress(assetMasternodeWinner, mapSeenSyncMNW.size());
             break;
         case (MASTERNODE_SYNC_BUDGET_PROP):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_MNW && RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
             sumBudgetItemProp += nCount;
             countBudgetItemProp++;
+            maxBudgetItemProp = std::max(maxBudgetItemProp, nCount);
+            assetBudget.nMaxReported = maxBudgetItemProp + maxBudgetItemFin;
             break;
         case (MASTERNODE_SYNC_BUDGET_FIN):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_MNW && RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
             sumBudgetItemFin += nCount;
             countBudgetItemFin++;
+            maxBudgetItemFin = std::max(maxBudgetItemFin, nCount);
+            assetBudget.nMaxReported = maxBudgetItemProp + maxBudgetItemFin;
+            CheckProgress(assetBudget, mapSeenSyncBudget.size());
             break;
         }
 
@@ -202,30 +240,75 @@ void CMasternodeSync::ClearFulfilledRequest()
 }
 
 void CMasternodeSync::Process()
+{
+    // mnodeman takes its own lock, which comes before cs
+    int nMnCount = mnodeman.CountEnabled();
+    std::vector<CNode*> vAskList;
+    bool fFinished;
+    {
+        LOCK(cs);
+        fFinished = Step(nMnCount, vAskList);
+    }
+
+    bool fListAskedRecently = false;
+    BOOST_FOREACH (CNode* pnode, vAskList) {
+        bool fAsked = mnodeman.DsegUpdate(pnode);
+        pnode->Release();
+
+        LOCK(cs);
+        if (RequestedMasternodeAssets != MASTERNODE_SYNC_LIST) continue;
+        // peers we asked shortly before a restart won't be asked again, don't wait for them
+        if (fAsked) {
+            assetMasternodeList.Asked();
+            RequestedMasternodeAttempt++;
+        } else {
+            fListAskedRecently = true;
+        }
+    }
+
+    if (fListAskedRecently) {
+        LOCK(cs);
+        // the list in the cache is one we asked these peers for lately, go on with it
+        if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST && assetMasternodeList.nAsked == 0 && mnodeman.size() > 0) {
+            LogPrint("masternode", "CMasternodeSync::Process - using the cached masternode list\n");
+            GetNextAsset();
+        }
+    }
+
+    if (fFinished) Finish();
+}
+
+/**
+ * One sync tick, with cs held. Peers to ask for the masternode list are
+ * returned referenced in vAskList, as asking goes through mnodeman. Returns
+ * true once the last stage completed.
+ */
+bool CMasternodeSync::Step(int nMnCount, std::vector<CNode*>& vAskList)
 {
     static int tick = 0;
     static int syncCount = 0;
 
-    if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
+    // called every MASTERNODE_SYNC_TIMEOUT seconds by the mnsync job
+    tick++;
 
     if (IsSynced()) {
         /* 
             Resync if we lose all masternodes from sleep/wake or failure to sync originally
         */
-        if (mnodeman.CountEnabled() == 0 ) {
+        if (nMnCount == 0 ) {
 			if(syncCount < 2){
-				Reset();
+				Clear();
 				syncCount++;
 			}
         } else
-            return;
+            return false;
     }
 
     //try syncing again
     if (RequestedMasternodeAssets == MASTERNODE_SYNC_FAILED && lastFailure + (1 * 60) < GetTime()) {
-        Reset();
+        Clear();
     } else if (RequestedMasternodeAssets == MASTERNODE_SYNC_FAILED) {
-        return;
+        return false;
     }
 
     LogPrint("masternode", "CMasternodeSync::Process() - tick %d RequestedMasternodeAssets %d\n", tick, RequestedMasternodeAssets);
@@ -235,19 +318,18 @@ void CMasternodeSync::Process()
 
     // sporks synced but blockchain is not, wait until we're almost at a recent block to continue
     if (ChainNameFromCommandLine() != CBaseChainParams::REGTEST &&
-        !IsBlockchainSynced() && RequestedMasternodeAssets > MASTERNODE_SYNC_SPORKS) return;
+        !IsBlockchainSynced() && RequestedMasternodeAssets > MASTERNODE_SYNC_SPORKS) return false;
 
     TRY_LOCK(cs_vNodes, lockRecv);
-    if (!lockRecv) return;
+    if (!lockRecv) return false;
 
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (ChainNameFromCommandLine() == CBaseChainParams::REGTEST) {
+    if (ChainNameFromCommandLine() == CBaseChainParams::REGTEST) {
+        BOOST_FOREACH (CNode* pnode, vNodes) {
             if (RequestedMasternodeAttempt <= 2) {
                 pnode->PushMessage("getsporks"); //get current network sporks
             } else if (RequestedMasternodeAttempt < 4) {
-                mnodeman.DsegUpdate(pnode);
+                vAskList.push_back(pnode->AddRef());
             } else if (RequestedMasternodeAttempt < 6) {
-                int nMnCount = mnodeman.CountEnabled();
                 pnode->PushMessage("mnget", nMnCount); //sync payees
                 uint256 n = uint256();
                 pnode->PushMessage("mnvs", n); //sync masternode votes
@@ -255,136 +337,144 @@ void CMasternodeSync::Process()
                 RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
             }
             RequestedMasternodeAttempt++;
-            return;
+            return false;
         }
+        return false;
+    }
 
-        //set to synced
-        if (RequestedMasternodeAssets == MASTERNODE_SYNC_SPORKS) {
-            if (pnode->HasFulfilledRequest("getspork")) continue;
-            pnode->FulfilledRequest("getspork");
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_SPORKS) {
+        // sporks are answered right away, one round trip to a couple of peers is enough
+        if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD && GetTime() - nAssetSyncStarted >= MASTERNODE_SYNC_TIMEOUT) {
+            GetNextAsset();
+        } else {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_PEERS) break;
+                if (pnode->fDisconnect || pnode->HasFulfilledRequest("getspork")) continue;
+                pnode->FulfilledRequest("getspork");
 
-            pnode->PushMessage("getsporks"); //get current network sporks
-            if (RequestedMasternodeAttempt >= 2) GetNextAsset();
-            RequestedMasternodeAttempt++;
+                pnode->PushMessage("getsporks"); //get current network sporks
+                RequestedMasternodeAttempt++;
+            }
+            return false;
+        }
+    }
 
-            return;
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
+        if (IsAssetSynced(assetMasternodeList, countMasternodeList, mapSeenSyncMNB.size(), lastMasternodeList)) {
+            GetNextAsset();
+        } else if (IsAssetTimedOut(assetMasternodeList, lastMasternodeList)) {
+            if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+                Fail();
+                return false;
+            }
+            GetNextAsset();
         }
+    }
 
-        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
-                if (lastMasternodeList > 0 && lastMasternodeList < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
+        if (IsAssetSynced(assetMasternodeWinner, countMasternodeWinner, mapSeenSyncMNW.size(), lastMasternodeWinner)) {
+            GetNextAsset();
+        } else if (IsAssetTimedOut(assetMasternodeWinner, lastMasternodeWinner)) {
+            if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+                Fail();
+                return false;
+            }
+            GetNextAsset();
+        }
+    }
 
-                if (pnode->HasFulfilledRequest("mnsync")) continue;
-                pnode->FulfilledRequest("mnsync");
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) {
+        // We'll start rejecting votes if we accidentally get set as synced too soon
+        if (IsAssetSynced(assetBudget, countBudgetItemFin, mapSeenSyncBudget.size(), lastBudgetItem) ||
+            IsAssetTimedOut(assetBudget, lastBudgetItem)) { // maybe there is no budgets at all, so just finish syncing
+            GetNextAsset();
+            return true;
+        }
+    }
 
-                // timeout
-                if (lastMasternodeList == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                mnodeman.DsegUpdate(pnode);
-                RequestedMasternodeAttempt++;
-                return;
-            }
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->fDisconnect) continue;
 
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
-                if (lastMasternodeWinner > 0 && lastMasternodeWinner < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
+        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto()) {
+            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST && assetMasternodeList.CanAsk(vAskList.size()) && !pnode->HasFulfilledRequest("mnsync")) {
+                pnode->FulfilledRequest("mnsync");
+                vAskList.push_back(pnode->AddRef());
+            }
 
-                if (pnode->HasFulfilledRequest("mnwsync")) continue;
+            if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW && assetMasternodeWinner.CanAsk() && !pnode->HasFulfilledRequest("mnwsync")) {
                 pnode->FulfilledRequest("mnwsync");
-
-                // timeout
-                if (lastMasternodeWinner == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                CBlockIndex* pindexPrev = chainActive.Tip();
-                if (pindexPrev == NULL) return;
-
-                int nMnCount = mnodeman.CountEnabled();
                 pnode->PushMessage("mnget", nMnCount); //sync payees
+                assetMasternodeWinner.Asked();
                 RequestedMasternodeAttempt++;
-
-                return;
             }
         }
 
         if (pnode->nVersion >= ActiveProtocol()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) {
-                
-                // We'll start rejecting votes if we accidentally get set as synced too soon
-                if (lastBudgetItem > 0 && lastBudgetItem < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { 
-                    
-                    // Hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-
-                    // Try to activate our masternode if possible
-                    activeMasternode.ManageStatus();
-
-                    //masternode protection code
-                    if(GetBoolArg("-masternodeconnections", false))
-                    {
-                        DisconnectNodes();
-                    }
-                    return;
-                }
-
-                // timeout
-                if (lastBudgetItem == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    // maybe there is no budgets at all, so just finish syncing
-                    GetNextAsset();
-                    activeMasternode.ManageStatus();
-
-                    //masternode protection code
-                    if(GetBoolArg("-masternodeconnections", false))
-                    {
-                        DisconnectNodes();
-                    }
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("busync")) continue;
+            // the budget only needs the list, ask for it along with the winners
+            if ((RequestedMasternodeAssets == MASTERNODE_SYNC_MNW || RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) &&
+                assetBudget.CanAsk() && !pnode->HasFulfilledRequest("busync")) {
                 pnode->FulfilledRequest("busync");
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
                 uint256 n = uint256();
                 pnode->PushMessage("mnvs", n); //sync masternode votes
-                RequestedMasternodeAttempt++;
-
-                return;
+                assetBudget.Asked();
             }
         }
     }
-}
\ No newline at end of file
+
+    return false;
+}
+
+/**
+ * An asset is synced once the peers asked (or MASTERNODE_SYNC_THRESHOLD of
+ * them) reported their inventory count and at least the largest count of
+ * distinct items came in; if some items never come, e.g. ones we reject,
+ * once nothing new came for a while after the reports.
+ */
+bool CMasternodeSync::IsAssetSynced(const CMasternodeSyncAsset& asset, int nReported, size_t nSeen, int64_t nLastItem) const
+{
+    if (asset.nAsked == 0) return false;
+
+    int64_t nNow = GetTime();
+    bool fQuiet = nLastItem > 0 && nLastItem < nNow - MASTERNODE_SYNC_TIMEOUT * 2;
+
+    if (nReported >= std::min(asset.nAsked, MASTERNODE_SYNC_THRESHOLD))
+        return (int)nSeen >= asset.nMaxReported || fQuiet;
+
+    // peers that don't report, fall back to the items drying up
+    return fQuiet && (nReported > 0 || nNow - asset.nStarted > MASTERNODE_SYNC_TIMEOUT * 5);
+}
+
+/** Nothing came in for an asset long after asking for it */
+bool CMasternodeSync::IsAssetTimedOut(const CMasternodeSyncAsset& asset, int64_t nLastItem) const
+{
+    int64_t nStarted = asset.nAsked > 0 ? asset.nStarted : nAssetSyncStarted;
+    return nLastItem == 0 && GetTime() - nStarted > MASTERNODE_SYNC_TIMEOUT * 5;
+}
+
+/** Move on as soon as the items the peers reported are in, instead of at the next sync tick */
+void CMasternodeSync::CheckProgress(const CMasternodeSyncAsset& asset, size_t nSeen)
+{
+    if (asset.nAsked > 0 && (int)nSeen >= asset.nMaxReported)
+        masternodeJobs.Trigger(MASTERNODE_JOB_SYNC);
+}
+
+void CMasternodeSync::Fail()
+{
+    LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
+    RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
+    RequestedMasternodeAttempt = 0;
+    lastFailure = GetTime();
+    nCountFailures++;
+}
+
+void CMasternodeSync::Finish()
+{
+    // Try to activate our masternode if possible
+    activeMasternode.ManageStatus();
+
+    //masternode protection code
+    if(GetBoolArg("-masternodeconnections", false))
+    {
+        DisconnectNodes();
+    }
+}
@@ -7,6 +7,11 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "sync.h"
+#include "utiltime.h"
+
+#include <atomic>
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -19,17 +24,66 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+#define MASTERNODE_SYNC_PEERS 3
 
 class CMasternodeSync;
+class CNode;
 extern CMasternodeSync masternodeSync;
 
+//
+// CMasternodeSyncAsset : Requests out for one asset and what the peers reported back
+//
+
+class CMasternodeSyncAsset
+{
+public:
+    // peers asked
+    int nAsked;
+    // largest inventory count a peer reported
+    int nMaxReported;
+    // time the first peer was asked
+    int64_t nStarted;
+
+    CMasternodeSyncAsset() { SetNull(); }
+
+    void SetNull()
+    {
+        nAsked = 0;
+        nMaxReported = 0;
+        nStarted = 0;
+    }
+
+    void Asked()
+    {
+        if (nAsked++ == 0) nStarted = GetTime();
+    }
+
+    /// Ask up to MASTERNODE_SYNC_PEERS peers at once, more if they are slow to deliver
+    bool CanAsk(int nPending = 0) const
+    {
+        if (nAsked + nPending < MASTERNODE_SYNC_PEERS) return true;
+        return nAsked + nPending < MASTERNODE_SYNC_THRESHOLD * 3 && GetTime() - nStarted > MASTERNODE_SYNC_TIMEOUT * 2;
+    }
+};
+
 //
 // CMasternodeSync : Sync masternode assets in stages
 //
+// Sporks come first. The list is then asked from several peers at once, and
+// the winners and the budget, which only need the list, are asked together.
+// A stage is complete once the peers reported how many items they have and
+// that many distinct items came in, instead of waiting on timeouts.
+//
+// The managers report items with their own locks held, so cs is taken after
+// theirs and Process calls back into them only once it let go of cs.
+//
 
 class CMasternodeSync
 {
 public:
+    // critical section to protect the inner data structures
+    mutable CCriticalSection cs;
+
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
     std::map<uint256, int> mapSeenSyncBudget;
@@ -51,13 +105,17 @@ public:
     int countBudgetItemProp;
     int countBudgetItemFin;
 
-    // Count peers we've requested the list from
-    int RequestedMasternodeAssets;
+    // Count peers we've requested the list from; the stage is read without cs
+    std::atomic<int> RequestedMasternodeAssets;
     int RequestedMasternodeAttempt;
 
     // Time when current masternode asset sync started
     int64_t nAssetSyncStarted;
 
+    CMasternodeSyncAsset assetMasternodeList;
+    CMasternodeSyncAsset assetMasternodeWinner;
+    CMasternodeSyncAsset assetBudget;
+
     CMasternodeSync();
 
     void AddedMasternodeList(uint256 hash);
@@ -78,6 +136,19 @@ public:
     bool IsWinnersListSynced() { return RequestedMasternodeAssets > MASTERNODE_SYNC_MNW; }
     bool IsSynced() { return RequestedMasternodeAssets == MASTERNODE_SYNC_FINISHED; }
     void ClearFulfilledRequest();
+
+private:
+    // largest budget inventory counts a peer reported
+    int maxBudgetItemProp;
+    int maxBudgetItemFin;
+
+    void Clear();
+    bool Step(int nMnCount, std::vector<CNode*>& vAskList);
+    bool IsAssetSynced(const CMasternodeSyncAsset& asset, int nReported, size_t nSeen, int64_t nLastItem) const;
+    bool IsAssetTimedOut(const CMasternodeSyncAsset& asset, int64_t nLastItem) const;
+    void CheckProgress(const CMasternodeSyncAsset& asset, size_t nSeen);
+    void Fail();
+    void Finish();
 };
 
 #endif
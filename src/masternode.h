@@ -61,6 +61,7 @@ public:
     }
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
+    std::string GetSignatureMessage();
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     void Relay();
 
@@ -143,6 +144,9 @@ public:
     int nScanningErrorCount;
     int nLastScanningErrorBlockHeight;
     CMasternodePing lastPing;
+    // the collateral was probed once; after that mnodeman follows its spends
+    // from validation events (not saved)
+    bool fCollateralChecked;
 
     int64_t nLastDsee;  // temporary, do not save. Remove after migration to v12
     int64_t nLastDseep; // temporary, do not save. Remove after migration to v12
@@ -175,6 +179,7 @@ public:
         swap(first.nLastDsq, second.nLastDsq);
         swap(first.nScanningErrorCount, second.nScanningErrorCount);
         swap(first.nLastScanningErrorBlockHeight, second.nLastScanningErrorBlockHeight);
+        swap(first.fCollateralChecked, second.fCollateralChecked);
     }
 
     CMasternode& operator=(CMasternode from)
@@ -219,7 +224,8 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    /// nMnCount is the number of enabled masternodes, or -1 to count them here
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -275,7 +281,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nMnCount = -1);
     bool IsValidNetAddr();
 };
 
@@ -293,6 +299,7 @@ public:
 
     bool CheckAndUpdate(int& nDoS);
     bool CheckInputsAndAdd(int& nDos);
+    std::string GetSignatureMessage();
     bool Sign(CKey& keyCollateralAddress);
     void Relay();
 
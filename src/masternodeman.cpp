@@ -12,7 +12,6 @@
 #include "spork.h"
 #include "util.h"
 #include "consensus/validation.h"
-#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
@@ -28,17 +27,9 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -48,151 +39,182 @@ struct CompareScoreMN {
 // CMasternodeDB
 //
 
-CMasternodeDB::CMasternodeDB()
+CMasternodeDB masternodeDB;
+
+enum {
+    // 1 held the whole manager in earlier versions of the file; it is skipped
+    RECORD_MASTERNODE_PING = 2,
+    RECORD_MASTERNODE_PING_ERASED = 3,
+    RECORD_MASTERNODE_STATE = 4,
+    RECORD_MASTERNODE = 5,
+    RECORD_MASTERNODE_ERASED = 6,
+    RECORD_MASTERNODE_BROADCAST = 7,
+    RECORD_MASTERNODE_BROADCAST_ERASED = 8
+};
+
+CMasternodeDB::CMasternodeDB() : log("mncache.dat", "MasternodeCache"), nStateSize(0), fLoaded(false)
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+template <typename Stream, typename Operation>
+void CMasternodeDB::StateSerializationOp(CMasternodeMan& obj, Stream& s, Operation ser_action)
 {
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
+    READWRITE(obj.mAskedUsForMasternodeList);
+    READWRITE(obj.mWeAskedForMasternodeList);
+    READWRITE(obj.mWeAskedForMasternodeListEntry);
+    READWRITE(obj.nDsqCount);
+}
 
-    return true;
+// A masternode is logged again only when a new broadcast replaces it; the
+// pings are logged on their own and its last ping is restored from them
+static uint256 GetMasternodeRecordHash(const CMasternode& mn)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << mn.vin;
+    ss << mn.sigTime;
+    return ss.GetHash();
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
+    LOCK(cs);
+    // don't log the entries that are still to be read as erased
+    if (!fLoaded) return false;
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
+    {
+        CMasternodeMan& obj = const_cast<CMasternodeMan&>(mnodemanToSave);
+        LOCK(obj.cs);
+
+        CDataStream ssState(SER_DISK, CLIENT_VERSION);
+        StateSerializationOp(obj, ssState, CSerActionSerialize());
+        uint256 hash = Hash(ssState.begin(), ssState.end());
+
+        std::map<uint256, const CMasternode*> mapMasternodes;
+        for (const CMasternode& mn : obj.vMasternodes)
+            mapMasternodes[GetMasternodeRecordHash(mn)] = &mn;
+
+        if (log.NeedsRewrite(nStateSize + indexMasternodes.GetLiveSize() + indexBroadcasts.GetLiveSize() + indexPings.GetLiveSize())) {
+            log.Reset();
+            log.Append(RECORD_MASTERNODE_STATE, ssState);
+            indexMasternodes.AppendAll(log, RECORD_MASTERNODE, mapMasternodes);
+            indexBroadcasts.AppendAll(log, RECORD_MASTERNODE_BROADCAST, obj.mapSeenMasternodeBroadcast);
+            indexPings.AppendAll(log, RECORD_MASTERNODE_PING, obj.mapSeenMasternodePing);
+        } else {
+            if (hash != hashState)
+                log.Append(RECORD_MASTERNODE_STATE, ssState);
+            indexMasternodes.AppendChanges(log, RECORD_MASTERNODE, RECORD_MASTERNODE_ERASED, mapMasternodes);
+            indexBroadcasts.AppendChanges(log, RECORD_MASTERNODE_BROADCAST, RECORD_MASTERNODE_BROADCAST_ERASED, obj.mapSeenMasternodeBroadcast);
+            indexPings.AppendChanges(log, RECORD_MASTERNODE_PING, RECORD_MASTERNODE_PING_ERASED, obj.mapSeenMasternodePing);
+        }
+        hashState = hash;
+        nStateSize = ssState.size();
     }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
+    if (!log.Flush()) return false;
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
+    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
+    return true;
+}
 
-        ssMasternodes >> strMagicMessageTmp;
+CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+{
+    LOCK(cs);
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
+    indexMasternodes.Clear();
+    indexBroadcasts.Clear();
+    indexPings.Clear();
+    hashState.SetNull();
+    nStateSize = 0;
+    fLoaded = true;
+
+    CMasternodeMan mnodemanLoaded;
+    std::map<uint256, CMasternode> mapMasternodes;
+    CRecordLog::ReadResult result = log.Replay([&](unsigned char nType, CDataStream& ssRecord) {
+        if (nType == RECORD_MASTERNODE_STATE) {
+            hashState = Hash(ssRecord.begin(), ssRecord.end());
+            nStateSize = ssRecord.size();
+            StateSerializationOp(mnodemanLoaded, ssRecord, CSerActionUnserialize());
+        } else if (nType == RECORD_MASTERNODE) {
+            std::pair<uint256, CMasternode> mn;
+            ssRecord >> mn;
+            mapMasternodes[mn.first] = mn.second;
+            indexMasternodes.Logged(mn.first, mn.second);
+        } else if (nType == RECORD_MASTERNODE_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mapMasternodes.erase(hash);
+            indexMasternodes.Erased(hash);
+        } else if (nType == RECORD_MASTERNODE_BROADCAST) {
+            std::pair<uint256, CMasternodeBroadcast> mnb;
+            ssRecord >> mnb;
+            mnodemanLoaded.mapSeenMasternodeBroadcast[mnb.first] = mnb.second;
+            indexBroadcasts.Logged(mnb.first, mnb.second);
+        } else if (nType == RECORD_MASTERNODE_BROADCAST_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mnodemanLoaded.mapSeenMasternodeBroadcast.erase(hash);
+            indexBroadcasts.Erased(hash);
+        } else if (nType == RECORD_MASTERNODE_PING) {
+            std::pair<uint256, CMasternodePing> ping;
+            ssRecord >> ping;
+            mnodemanLoaded.mapSeenMasternodePing[ping.first] = ping.second;
+            indexPings.Logged(ping.first, ping.second);
+        } else if (nType == RECORD_MASTERNODE_PING_ERASED) {
+            uint256 hash;
+            ssRecord >> hash;
+            mnodemanLoaded.mapSeenMasternodePing.erase(hash);
+            indexPings.Erased(hash);
         }
+    });
+    if (result == CRecordLog::FileError) return FileError;
+    if (result == CRecordLog::IncorrectMagicMessage) return IncorrectMagicMessage;
+    if (result == CRecordLog::IncorrectMagicNumber) return IncorrectMagicNumber;
+
+    // the newest ping of each masternode
+    std::map<COutPoint, const CMasternodePing*> mapLastPing;
+    for (const std::pair<const uint256, CMasternodePing>& ping : mnodemanLoaded.mapSeenMasternodePing) {
+        const CMasternodePing*& plastPing = mapLastPing[ping.second.vin.prevout];
+        if (plastPing == NULL || ping.second.sigTime > plastPing->sigTime)
+            plastPing = &ping.second;
+    }
 
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
+    {
+        // entries that arrived while the file was read are newer, keep those
+        LOCK(mnodemanToLoad.cs);
+        for (std::pair<const uint256, CMasternode>& mn : mapMasternodes) {
+            if (mnodemanToLoad.Find(mn.second.vin) != NULL) continue;
+            std::map<COutPoint, const CMasternodePing*>::iterator it = mapLastPing.find(mn.second.vin.prevout);
+            if (it != mapLastPing.end() && it->second->sigTime > mn.second.lastPing.sigTime)
+                mn.second.lastPing = *it->second;
+            mnodemanToLoad.vMasternodes.push_back(mn.second);
+            mnodemanToLoad.IndexMasternode(mnodemanToLoad.vMasternodes.back());
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+        mnodemanToLoad.ClearRankCache();
+        for (std::pair<const uint256, CMasternodeBroadcast>& mnb : mnodemanLoaded.mapSeenMasternodeBroadcast) {
+            std::map<COutPoint, const CMasternodePing*>::iterator it = mapLastPing.find(mnb.second.vin.prevout);
+            if (it != mapLastPing.end() && it->second->sigTime > mnb.second.lastPing.sigTime)
+                mnb.second.lastPing = *it->second;
+            mnodemanToLoad.mapSeenMasternodeBroadcast.insert(mnb);
+        }
+        mnodemanToLoad.mapSeenMasternodePing.insert(mnodemanLoaded.mapSeenMasternodePing.begin(), mnodemanLoaded.mapSeenMasternodePing.end());
+        mnodemanToLoad.mAskedUsForMasternodeList.insert(mnodemanLoaded.mAskedUsForMasternodeList.begin(), mnodemanLoaded.mAskedUsForMasternodeList.end());
+        mnodemanToLoad.mWeAskedForMasternodeList.insert(mnodemanLoaded.mWeAskedForMasternodeList.begin(), mnodemanLoaded.mWeAskedForMasternodeList.end());
+        mnodemanToLoad.mWeAskedForMasternodeListEntry.insert(mnodemanLoaded.mWeAskedForMasternodeListEntry.begin(), mnodemanLoaded.mWeAskedForMasternodeListEntry.end());
+        mnodemanToLoad.nDsqCount = std::max(mnodemanToLoad.nDsqCount, mnodemanLoaded.nDsqCount);
     }
 
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    }
+    LogPrint("masternode","Masternode manager - cleaning....\n");
+    mnodemanToLoad.CheckAndRemove(true);
+    LogPrint("masternode","Masternode manager - result:\n");
+    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
 
     return Ok;
 }
 
 void DumpMasternodes()
 {
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError) {
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    } else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat) {
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        } else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
-
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+    masternodeDB.Write(mnodeman);
 }
 
 CMasternodeMan::CMasternodeMan()
@@ -211,6 +233,8 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        IndexMasternode(vMasternodes.back());
+        ClearRankCache();
         return true;
     }
 
@@ -249,7 +273,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
+    std::list<CMasternode>::iterator it = vMasternodes.begin();
     while (it != vMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
@@ -263,7 +287,10 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
             while (it3 != mapSeenMasternodeBroadcast.end()) {
                 if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                    {
+                        LOCK(masternodeSync.cs);
+                        masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                    }
                     mapSeenMasternodeBroadcast.erase(it3++);
                 } else {
                     ++it3;
@@ -280,7 +307,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
+            UnindexMasternode(*it);
             it = vMasternodes.erase(it);
+            ClearRankCache();
         } else {
             ++it;
         }
@@ -320,8 +349,11 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
     while (it3 != mapSeenMasternodeBroadcast.end()) {
         if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
+            {
+                LOCK(masternodeSync.cs);
+                masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+            }
             mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
         } else {
             ++it3;
         }
@@ -342,6 +374,11 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    mapByCollateral.clear();
+    mapByPubKey.clear();
+    mapByPayee.clear();
+    mapByAddr.clear();
+    ClearRankCache();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -416,7 +453,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
     }
 }
 
-void CMasternodeMan::DsegUpdate(CNode* pnode)
+bool CMasternodeMan::DsegUpdate(CNode* pnode)
 {
     LOCK(cs);
 
@@ -426,7 +463,7 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
             if (it != mWeAskedForMasternodeList.end()) {
                 if (GetTime() < (*it).second) {
                     LogPrint("masternode", "dseg - we already asked peer %i for the list; skipping...\n", pnode->GetId());
-                    return;
+                    return false;
                 }
             }
         }
@@ -435,30 +472,23 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
+    return true;
 }
 
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    for (CMasternode& mn : vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CScript, CMasternode*>::iterator it = mapByPayee.find(payee);
+    return it == mapByPayee.end() ? NULL : it->second;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    for (CMasternode& mn : vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, CMasternode*, SaltedOutpointHasher>::iterator it = mapByCollateral.find(vin.prevout);
+    return it == mapByCollateral.end() ? NULL : it->second;
 }
 
 
@@ -466,22 +496,16 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    for (CMasternode& mn : vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CPubKey, CMasternode*>::iterator it = mapByPubKey.find(pubKeyMasternode);
+    return it == mapByPubKey.end() ? NULL : it->second;
 }
 
 CMasternode* CMasternodeMan::Find(const CAddress& addr)
 {
     LOCK(cs);
 
-    for (CMasternode& mn : vMasternodes) {
-        if ((CNetAddr)(mn.addr) == (CNetAddr)addr)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CNetAddr, CMasternode*>::iterator it = mapByAddr.find((CNetAddr)addr);
+    return it == mapByAddr.end() ? NULL : it->second;
 }
 
 //
@@ -515,7 +539,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -614,85 +638,104 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeRankTable& CMasternodeMan::GetRankTable(const uint256& blockHash, int minProtocol, int nFlags)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
-    int64_t nMasternode_Age = 0;
+    // Masternode states only move on every MASTERNODE_CHECK_SECONDS, so a
+    // table that young still agrees with a fresh scan of the list.
+    int64_t nNow = GetTime();
+    for (std::list<CMasternodeRankTable>::iterator it = lRankCache.begin(); it != lRankCache.end(); ++it) {
+        if (it->blockHash == blockHash && it->minProtocol == minProtocol && it->nFlags == nFlags) {
+            if (nNow - it->nTimeCreated >= MASTERNODE_CHECK_SECONDS) {
+                lRankCache.erase(it);
+                break;
+            }
+            lRankCache.splice(lRankCache.begin(), lRankCache, it);
+            return lRankCache.front();
+        }
+    }
 
-    //make sure we know about this block
-    uint256 blockHash = uint256();
-    if (!GetBlockHash(blockHash, nBlockHeight)) return -1;
+    std::vector<pair<int64_t, CMasternode*> > vecMasternodeScores;
+    bool fMinAge = (nFlags & RANK_MIN_AGE) && IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
-    // scan for winner
     for (CMasternode& mn : vMasternodes) {
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = GetTime() - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
+        if (fMinAge) {
+            int64_t nMasternode_Age = nNow - mn.sigTime;
+            if (nMasternode_Age < MN_WINNER_MINIMUM_AGE) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
                 continue;                                                   // Skip masternodes younger than (default) 1 hour
             }
         }
-        if (fOnlyActive) {
+
+        if (nFlags & (RANK_ONLY_ACTIVE | RANK_INACTIVE_LAST)) {
             mn.Check();
-            if (!mn.IsEnabled()) continue;
+            if (!mn.IsEnabled()) {
+                if (nFlags & RANK_INACTIVE_LAST)
+                    vecMasternodeScores.push_back(make_pair(9999, &mn));
+                continue;
+            }
         }
+
         arith_uint256 n = mn.CalculateScore(blockHash);
         int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(make_pair(n2, &mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
 
-    int rank = 0;
-    for (std::pair<int64_t, CTxIn>& s : vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+    if (lRankCache.size() >= MASTERNODE_RANK_CACHE_SIZE)
+        lRankCache.pop_back();
+    lRankCache.push_front(CMasternodeRankTable());
+    CMasternodeRankTable& table = lRankCache.front();
+    table.blockHash = blockHash;
+    table.minProtocol = minProtocol;
+    table.nFlags = nFlags;
+    table.nTimeCreated = nNow;
+    table.vRanked.reserve(vecMasternodeScores.size());
+    table.mapRank.reserve(vecMasternodeScores.size());
+    for (std::pair<int64_t, CMasternode*>& s : vecMasternodeScores) {
+        table.vRanked.push_back(s.second);
+        table.mapRank[s.second->vin.prevout] = table.vRanked.size();
     }
 
-    return -1;
+    return table;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
-
     //make sure we know about this block
     uint256 blockHash = uint256();
-    if (!GetBlockHash(blockHash, nBlockHeight)) return vecMasternodeRanks;
-
-    // scan for winner
-    for (CMasternode& mn : vMasternodes) {
-        mn.Check();
-
-        if (mn.protocolVersion < minProtocol) continue;
+    if (!GetBlockHash(blockHash, nBlockHeight)) return -1;
 
-        if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
-            continue;
-        }
+    LOCK(cs);
+    const CMasternodeRankTable& table = GetRankTable(blockHash, minProtocol, RANK_MIN_AGE | (fOnlyActive ? RANK_ONLY_ACTIVE : 0));
+    boost::unordered_map<COutPoint, int, SaltedOutpointHasher>::const_iterator it = table.mapRank.find(vin.prevout);
+    if (it == table.mapRank.end())
+        return -1;
 
-        arith_uint256 n = mn.CalculateScore(blockHash);
-        int64_t n2 = n.GetCompact(false);
+    return it->second;
+}
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    //make sure we know about this block
+    uint256 blockHash = uint256();
+    if (!GetBlockHash(blockHash, nBlockHeight)) return vecMasternodeRanks;
 
+    LOCK(cs);
+    const CMasternodeRankTable& table = GetRankTable(blockHash, minProtocol, RANK_INACTIVE_LAST);
+    vecMasternodeRanks.reserve(table.vRanked.size());
     int rank = 0;
-    for (std::pair<int64_t, CMasternode>& s : vecMasternodeScores) {
+    for (CMasternode* pmn : table.vRanked) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -700,39 +743,18 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
     uint256 blockHash;
     if(!GetBlockHash(blockHash, nBlockHeight)) {
         LogPrintf("CMasternode::GetMasternodeByRank -- ERROR: GetBlockHash() failed at nBlockHeight %d\n", nBlockHeight);
         return NULL;
     }
 
-    // scan for winner
-    for (CMasternode& mn : vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-
-        arith_uint256 n = mn.CalculateScore(blockHash);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    for (std::pair<int64_t, CTxIn>& s : vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    LOCK(cs);
+    const CMasternodeRankTable& table = GetRankTable(blockHash, minProtocol, fOnlyActive ? RANK_ONLY_ACTIVE : 0);
+    if (nRank < 1 || nRank > (int)table.vRanked.size())
+        return NULL;
 
-    return NULL;
+    return table.vRanked[nRank - 1];
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -788,7 +810,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
+        //  - this is checked later by .check() in many places and by the mnlist job
         if (mnb.CheckInputsAndAdd(nDoS)) {
             // use this as a peer
             addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
@@ -974,6 +996,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (pmn->nLastDsee < sigTime) { //take the newest entry
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
+                        LOCK(cs);
+                        UnindexMasternode(*pmn);
                         pmn->pubKeyMasternode = pubkey2;
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
@@ -981,6 +1005,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->addr = addr;
                         //fake ping
                         pmn->lastPing = CMasternodePing(vin);
+                        IndexMasternode(*pmn);
+                        ClearRankCache();
                     }
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
@@ -1015,7 +1041,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("masternode", "dsee - Got NEW OLD Masternode entry %s\n", vin.prevout.hash.ToString());
 
         // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
+        //  - this is checked later by .check() in many places and by the mnlist job
 
         CValidationState state;
         CMutableTransaction tx = CMutableTransaction();
@@ -1170,15 +1196,19 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
+    CMasternode* pmn = Find(vin);
+    if (pmn == NULL || pmn->vin != vin)
+        return;
+
+    LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+    UnindexMasternode(*pmn);
+    for (std::list<CMasternode>::iterator it = vMasternodes.begin(); it != vMasternodes.end(); ++it) {
+        if (&(*it) == pmn) {
             vMasternodes.erase(it);
             break;
         }
-        ++it;
     }
+    ClearRankCache();
 }
 
 void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
@@ -1195,11 +1225,118 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         if (Add(mn)) {
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
-    } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+    } else if (UpdateFromNewBroadcast(*pmn, mnb)) {
         masternodeSync.AddedMasternodeList(mnb.GetHash());
     }
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    UnindexMasternode(mn);
+    bool fUpdated = mn.UpdateFromNewBroadcast(mnb);
+    IndexMasternode(mn);
+    if (fUpdated)
+        ClearRankCache();
+
+    return fUpdated;
+}
+
+template <typename Key>
+static void EraseFromIndex(std::multimap<Key, CMasternode*>& mapIndex, const Key& key, const CMasternode* pmn)
+{
+    typedef typename std::multimap<Key, CMasternode*>::iterator iterator;
+    std::pair<iterator, iterator> range = mapIndex.equal_range(key);
+    for (iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapIndex.erase(it);
+            return;
+        }
+    }
+}
+
+void CMasternodeMan::IndexMasternode(CMasternode& mn)
+{
+    mapByCollateral[mn.vin.prevout] = &mn;
+    mapByPubKey.insert(std::make_pair(mn.pubKeyMasternode, &mn));
+    mapByPayee.insert(std::make_pair(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), &mn));
+    mapByAddr.insert(std::make_pair((CNetAddr)mn.addr, &mn));
+}
+
+void CMasternodeMan::UnindexMasternode(CMasternode& mn)
+{
+    mapByCollateral.erase(mn.vin.prevout);
+    EraseFromIndex(mapByPubKey, mn.pubKeyMasternode, &mn);
+    EraseFromIndex(mapByPayee, GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), &mn);
+    EraseFromIndex(mapByAddr, (CNetAddr)mn.addr, &mn);
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapByCollateral.clear();
+    mapByPubKey.clear();
+    mapByPayee.clear();
+    mapByAddr.clear();
+    for (CMasternode& mn : vMasternodes)
+        IndexMasternode(mn);
+    ClearRankCache();
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock, const int nHeight)
+{
+    if (tx.IsCoinBase()) return;
+
+    // Confirmed or only in the mempool, a spend takes the masternode out
+    // the same way a failed AcceptableInputs probe in Check does
+    LOCK(cs);
+    for (const CTxIn& txin : tx.vin) {
+        auto it = mapByCollateral.find(txin.prevout);
+        if (it == mapByCollateral.end() || it->second->activeState == CMasternode::MASTERNODE_VIN_SPENT) continue;
+
+        LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s spent by %s\n", txin.prevout.ToString(), tx.GetHash().ToString());
+        it->second->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        ClearRankCache();
+    }
+}
+
+void CMasternodeMan::ChainTip(const CBlockIndex* pindex, const CBlock* pblock, std::optional<std::pair<SproutMerkleTree, SaplingMerkleTree>> added)
+{
+    // Connected blocks arrive through SyncTransaction
+    if (added || pblock == NULL) return;
+
+    // A disconnected spend may not make it back into the mempool, so have
+    // the next Check probe the collateral again. The probe itself needs
+    // cs_main, which this thread must not take, so it is left to the mnlist
+    // job.
+    LOCK(cs);
+    for (const CTransaction& tx : pblock->vtx) {
+        if (tx.IsCoinBase()) continue;
+        for (const CTxIn& txin : tx.vin) {
+            auto it = mapByCollateral.find(txin.prevout);
+            if (it == mapByCollateral.end()) continue;
+
+            CMasternode* pmn = it->second;
+            pmn->fCollateralChecked = false;
+            if (pmn->activeState == CMasternode::MASTERNODE_VIN_SPENT) {
+                pmn->activeState = CMasternode::MASTERNODE_ENABLED;
+                ClearRankCache();
+            }
+        }
+    }
+
+    // A collateral created in the disconnected block is unconfirmed or gone
+    std::set<uint256> setTxids;
+    for (const CTransaction& tx : pblock->vtx)
+        setTxids.insert(tx.GetHash());
+    for (CMasternode& mn : vMasternodes) {
+        if (!setTxids.count(mn.vin.prevout.hash)) continue;
+
+        LogPrint("masternode", "CMasternodeMan::ChainTip - collateral %s disconnected\n", mn.vin.prevout.ToString());
+        mn.fCollateralChecked = false;
+    }
+}
+
 bool CMasternodeMan::HasEnabledMasternode(int protocolVersion)
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
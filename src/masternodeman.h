@@ -12,11 +12,17 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "recordlog.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
 
-#define MASTERNODES_DUMP_SECONDS (15 * 60)
+#include <list>
+#include <map>
+
+#define MASTERNODES_FLUSH_SECONDS 10
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODE_RANK_CACHE_SIZE 16
 
 using namespace std;
 
@@ -26,12 +32,28 @@ extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
+ *
+ * The file is a CRecordLog holding the masternodes, the seen broadcasts and
+ * the seen pings, one record each, and the peer bookkeeping as a small state
+ * record that is appended again when it changes. A masternode or broadcast
+ * record is only written again for a new broadcast; the last ping is taken
+ * from the ping records on load.
  */
 class CMasternodeDB
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    CCriticalSection cs;
+    CRecordLog log;
+    CRecordLogIndex indexMasternodes;
+    CRecordLogIndex indexBroadcasts;
+    CRecordLogIndex indexPings;
+    uint256 hashState;
+    uint64_t nStateSize;
+    // Read has run, so the log and the indexes match the manager
+    bool fLoaded;
+
+    template <typename Stream, typename Operation>
+    static void StateSerializationOp(CMasternodeMan& obj, Stream& s, Operation ser_action);
 
 public:
     enum ReadResult {
@@ -45,11 +67,30 @@ public:
     };
 
     CMasternodeDB();
+    /// Append the entries and the state that changed since the last write; does nothing before Read
     bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    /// Add what the file holds to the manager, keeping the entries it already has
+    ReadResult Read(CMasternodeMan& mnodemanToLoad);
+};
+
+extern CMasternodeDB masternodeDB;
+
+/** Masternode ranks for one block hash, protocol version and filter
+ */
+class CMasternodeRankTable
+{
+public:
+    uint256 blockHash;
+    int minProtocol;
+    int nFlags;
+    int64_t nTimeCreated;
+    // entries of vMasternodes, best score first
+    std::vector<CMasternode*> vRanked;
+    // 1-based rank of every ranked masternode by collateral
+    boost::unordered_map<COutPoint, int, SaltedOutpointHasher> mapRank;
 };
 
-class CMasternodeMan
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -58,8 +99,15 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // all MNs; a list so that the indexes below and pointers handed out by
+    // Find stay valid while other entries come and go
+    std::list<CMasternode> vMasternodes;
+    // indexes into vMasternodes, kept in step by Add, Remove, CheckAndRemove,
+    // Clear and UpdateFromNewBroadcast
+    boost::unordered_map<COutPoint, CMasternode*, SaltedOutpointHasher> mapByCollateral;
+    std::multimap<CPubKey, CMasternode*> mapByPubKey;
+    std::multimap<CScript, CMasternode*> mapByPayee;
+    std::multimap<CNetAddr, CMasternode*> mapByAddr;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -67,6 +115,31 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    enum RankFlags {
+        RANK_ONLY_ACTIVE = (1 << 0),    // leave out masternodes that are not enabled
+        RANK_MIN_AGE = (1 << 1),        // leave out young masternodes while payments are enforced
+        RANK_INACTIVE_LAST = (1 << 2),  // rank masternodes that are not enabled behind the others
+    };
+
+    // most recently used rank tables first; entries in them are only
+    // valid until vMasternodes changes, which clears the cache
+    std::list<CMasternodeRankTable> lRankCache;
+
+    /// Rank table for the given block, computed if not cached (requires cs)
+    const CMasternodeRankTable& GetRankTable(const uint256& blockHash, int minProtocol, int nFlags);
+    void ClearRankCache() { lRankCache.clear(); }
+
+    void IndexMasternode(CMasternode& mn);
+    void UnindexMasternode(CMasternode& mn);
+    void RebuildIndexes();
+
+    friend class CMasternodeDB;
+
+protected:
+    // Collateral spends, pushed from the wallet notification thread
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock, const int nHeight);
+    void ChainTip(const CBlockIndex* pindex, const CBlock* pblock, std::optional<std::pair<SproutMerkleTree, SaplingMerkleTree>> added);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -82,7 +155,11 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action)
     {
         LOCK(cs);
+        if (ser_action.ForRead())
+            ClearRankCache();
         READWRITE(vMasternodes);
+        if (ser_action.ForRead())
+            RebuildIndexes();
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -114,7 +191,8 @@ public:
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
-    void DsegUpdate(CNode* pnode);
+    /// Ask pnode for the list, returns false if we asked it recently
+    bool DsegUpdate(CNode* pnode);
 
     /// Find an entry
     CMasternode* Find(const CScript& payee);
@@ -134,7 +212,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(vMasternodes.begin(), vMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -158,6 +237,9 @@ public:
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 
+    /// Update an entry of the list from a newer broadcast, keeping the indexes in step
+    bool UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb);
+
     bool HasEnabledMasternode(int protocolVersion = -1);
 };
 
@@ -21,6 +21,10 @@ const int64_t DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES = 60;
 const size_t EVICTION_MEMORY_ENTRIES = 40000;
 const uint64_t MIN_TX_COST = 4000;
 const uint64_t LOW_FEE_PENALTY = 16000;
+// Once the total cost reaches this percentage of the limit, the mempool starts
+// advertising a minimum fee so peers stop relaying transactions that carry the
+// low fee penalty and would be the first to be evicted.
+const int64_t MEMPOOL_MIN_FEE_COST_PERCENT = 90;
 
 
 // This class keeps track of transactions which have been recently evicted from the mempool
@@ -47,6 +51,34 @@ public:
 
     void add(const uint256& txId);
     bool contains(const uint256& txId);
+
+    // The eviction times are kept across a restart, so that entries still
+    // expire when they would have.
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        std::vector<std::pair<uint256, int64_t>> vTxIdsAndTimes(txIdsAndTimes.begin(), txIdsAndTimes.end());
+        ::Serialize(s, vTxIdsAndTimes);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        std::vector<std::pair<uint256, int64_t>> vTxIdsAndTimes;
+        ::Unserialize(s, vTxIdsAndTimes);
+        for (const std::pair<uint256, int64_t>& txIdAndTime : vTxIdsAndTimes) {
+            if (txIdSet.count(txIdAndTime.first)) {
+                continue;
+            }
+            if (txIdsAndTimes.size() == capacity) {
+                txIdSet.erase(txIdsAndTimes.front().first);
+                txIdsAndTimes.pop_front();
+            }
+            txIdsAndTimes.push_back(txIdAndTime);
+            txIdSet.insert(txIdAndTime.first);
+        }
+        pruneList();
+    }
 };
 
 
@@ -118,6 +150,7 @@ public:
     }
 
     TxWeight getTotalWeight() const;
+    int64_t getCapacity() const { return capacity; }
 
     void add(const WeightedTxInfo& weightedTxInfo);
     void remove(const uint256& txId);
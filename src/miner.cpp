@@ -39,7 +39,6 @@
 #include <librustzcash.h>
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
@@ -52,55 +51,588 @@ using namespace std;
 // BitcoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The mempool caches, for every entry, the
+// size and (modified) fees of the entry together with all of its in-mempool
+// ancestors, and keeps an index sorted by that "ancestor fee rate". We select
+// whole packages (a transaction plus its not-yet-included ancestors) in that
+// order, so a high-fee child pays for its low-fee parents.
 //
-class COrphan
+// Once some of a transaction's ancestors are in the block, its cached
+// ancestor state overstates the package that is still needed. Such entries
+// are tracked in an indexed_modified_transaction_set with the included
+// ancestors subtracted out.
+//
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+// This matches CompareTxMemPoolEntryByAncestorFee, but operates on the
+// modified package state.
+class CompareModifiedEntry
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
     {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by mempool entry
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::nth_index<1>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-    bool byFee;
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
 
+    CTxMemPool::txiter iter;
+};
+
+// A parent always has fewer in-mempool ancestors than its children, so
+// sorting a package by ancestor count yields a valid block order.
+class CompareTxIterByAncestorCount
+{
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+// We want to sort transactions by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
+{
+public:
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFee()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
+/**
+ * Selects mempool transactions for a new block template. Must be used with
+ * cs_main and mempool.cs held, and only for the lifetime of one template.
+ */
+class BlockAssembler
+{
+private:
+    const CChainParams& chainparams;
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CCoinsViewCache& view;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    uint32_t consensusBranchId;
+    bool fPrintPriority;
+
+    // Value pool tracking for the ZIP 209 turnstile
+    CAmount sproutValue;
+    CAmount saplingValue;
+    bool monitoring_pool_balances;
+
+public:
+    BlockAssembler(const CChainParams& _chainparams, CBlockTemplate* _pblocktemplate,
+                   CCoinsViewCache& _view, const CBlockIndex* pindexPrev, int64_t _nLockTimeCutoff);
+
+    /** Add transactions based on modified coin-age priority, up to -blockprioritysize */
+    void AddPriorityTxs();
+    /** Add transactions based on modified ancestor-package fee rate */
+    void AddPackageTxs();
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Test if a package of transactions fits in the block, is final, and
+     *  passes the same input checks ConnectBlock would apply. On success the
+     *  transactions are appended to the block; on failure nothing changes.
+     *  failedEntry is set to the transaction that can never be included in
+     *  this block, or to the last package entry if the package merely does
+     *  not fit. */
+    bool TestAndAddPackage(const std::vector<CTxMemPool::txiter>& package, CTxMemPool::txiter& failedEntry);
+    /** Remove confirmed (inBlock) entries from given set */
+    void OnlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Return true if given transaction from mapTx has already been evaluated,
+     *  or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx);
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+     *  state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+    /** Whether a transaction still depends on mempool transactions not yet in the block. */
+    bool IsStillDependent(CTxMemPool::txiter iter);
+};
+
+BlockAssembler::BlockAssembler(const CChainParams& _chainparams, CBlockTemplate* _pblocktemplate,
+                               CCoinsViewCache& _view, const CBlockIndex* pindexPrev, int64_t _nLockTimeCutoff)
+    : chainparams(_chainparams), pblocktemplate(_pblocktemplate), pblock(&_pblocktemplate->block), view(_view),
+      nLockTimeCutoff(_nLockTimeCutoff)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    nBlockSize = 1000;
+    nBlockTx = 0;
+    nBlockSigOps = 100;
+    nFees = 0;
+
+    nHeight = pindexPrev->nHeight + 1;
+    consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+    fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+
+    // We want to track the value pool, but if the miner gets
+    // invoked on an old block before the hardcoded fallback
+    // is active we don't want to trip up any assertions. So,
+    // we only adhere to the turnstile (as a miner) if we
+    // actually have all of the information necessary to do
+    // so.
+    sproutValue = 0;
+    saplingValue = 0;
+    monitoring_pool_balances = true;
+    if (chainparams.ZIP209Enabled()) {
+        if (pindexPrev->nChainSproutValue) {
+            sproutValue = *pindexPrev->nChainSproutValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+        if (pindexPrev->nChainSaplingValue) {
+            saplingValue = *pindexPrev->nChainSaplingValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+    }
+}
+
+bool BlockAssembler::TestAndAddPackage(const std::vector<CTxMemPool::txiter>& package, CTxMemPool::txiter& failedEntry)
+{
+    // Changes are staged in a child view so a package that fails halfway
+    // leaves the block untouched.
+    CCoinsViewCache viewPackage(&view);
+    CAmount sproutValuePackage = sproutValue;
+    CAmount saplingValuePackage = saplingValue;
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    std::vector<CAmount> vPackageFees;
+    std::vector<unsigned int> vPackageSigOps;
+
+    failedEntry = package.back();
+    for (const CTxMemPool::txiter& it : package) {
+        const CTransaction& tx = it->GetTx();
+
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight)) {
+            failedEntry = it;
+            return false;
+        }
+
+        // Size limits
+        nPackageSize += it->GetTxSize();
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nPackageSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!viewPackage.HaveInputs(tx)) {
+            failedEntry = it;
+            return false;
+        }
+
+        CAmount nTxFees = viewPackage.GetValueIn(tx)-tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, viewPackage);
+        if (nBlockSigOps + nPackageSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        PrecomputedTransactionData txdata(tx);
+        if (!ContextualCheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId)) {
+            failedEntry = it;
+            return false;
+        }
+
+        if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
+            // Does this transaction lead to a turnstile violation?
+
+            CAmount sproutValueDummy = sproutValuePackage;
+            CAmount saplingValueDummy = saplingValuePackage;
+
+            saplingValueDummy += -tx.valueBalance;
+
+            for (auto js : tx.vJoinSplit) {
+                sproutValueDummy += js.vpub_old;
+                sproutValueDummy -= js.vpub_new;
+            }
+
+            if (sproutValueDummy < 0) {
+                LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
+                failedEntry = it;
+                return false;
+            }
+            if (saplingValueDummy < 0) {
+                LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
+                failedEntry = it;
+                return false;
+            }
+
+            sproutValuePackage = sproutValueDummy;
+            saplingValuePackage = saplingValueDummy;
         }
-        else
+
+        UpdateCoins(tx, viewPackage, nHeight);
+
+        nPackageSigOps += nTxSigOps;
+        vPackageFees.push_back(nTxFees);
+        vPackageSigOps.push_back(nTxSigOps);
+    }
+
+    viewPackage.Flush();
+    sproutValue = sproutValuePackage;
+    saplingValue = saplingValuePackage;
+
+    for (size_t i = 0; i < package.size(); i++) {
+        const CTxMemPool::txiter& it = package[i];
+        const CTransaction& tx = it->GetTx();
+
+        // Added
+        pblock->vtx.push_back(tx);
+        pblocktemplate->vTxFees.push_back(vPackageFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vPackageSigOps[i]);
+        nBlockSize += it->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vPackageSigOps[i];
+        nFees += vPackageFees[i];
+        inBlock.insert(it);
+
+        if (fPrintPriority)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            double dPriority = it->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), tx.GetHash().ToString());
         }
     }
-};
+    return true;
+}
+
+void BlockAssembler::OnlyUnconfirmed(CTxMemPool::setEntries& testSet)
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit)) {
+            testSet.erase(iit++);
+        }
+        else {
+            iit++;
+        }
+    }
+}
+
+bool BlockAssembler::IsStillDependent(CTxMemPool::txiter iter)
+{
+    for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(iter))
+    {
+        if (!inBlock.count(parent)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set& mapModifiedTx)
+{
+    for (const CTxMemPool::txiter it : alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        for (CTxMemPool::txiter desc : descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block).
+// Also skip transactions that we've already failed to add.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx)
+{
+    assert (it != mempool.mapTx.end());
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void BlockAssembler::AddPriorityTxs()
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    if (nBlockPrioritySize == 0) {
+        return;
+    }
+
+    // This vector will be sorted into a priority queue. Heapifying is linear
+    // in the size of the mempool and only the transactions that make it into
+    // the priority area are popped.
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions; everything left is considered by AddPackageTxs.
+        if ((nBlockSize + iter->GetTxSize() >= nBlockPrioritySize) || !AllowFree(actualPriority)) {
+            break;
+        }
+
+        CTxMemPool::txiter failedEntry;
+        if (TestAndAddPackage(std::vector<CTxMemPool::txiter>(1, iter), failedEntry)) {
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(iter))
+            {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+}
+
+void BlockAssembler::AddPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    typedef CTxMemPool::indexed_transaction_set::nth_index<2>::type ancestor_score_index;
+    const ancestor_score_index& mapTxByAncestorScore = mempool.mapTx.get<2>();
+    ancestor_score_index::iterator mi = mapTxByAncestorScore.begin();
+    CTxMemPool::txiter iter;
+    while (mi != mapTxByAncestorScore.end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mapTxByAncestorScore.end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<1>().begin();
+        if (mi == mapTxByAncestorScore.end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<1>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+        }
+
+        // Skip free transactions if we're past the minimum block size.
+        // Everything else we might consider has a lower fee rate.
+        if (CFeeRate(packageFees, packageSize) < ::minRelayTxFee && (nBlockSize + packageSize >= nBlockMinSize)) {
+            return;
+        }
+
+        if (nBlockSize + packageSize >= nBlockMaxSize) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<1>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        OnlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
+
+        // Package can be added if every transaction in it is valid.
+        // Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+
+        CTxMemPool::txiter failedEntry;
+        if (!TestAndAddPackage(sortedEntries, failedEntry)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<1>().erase(modit);
+            }
+            failedTx.insert(iter);
+            if (failedEntry != iter) {
+                // An ancestor could not be added; don't try it again on its own.
+                mapModifiedTx.erase(failedEntry);
+                failedTx.insert(failedEntry);
+            }
+            continue;
+        }
+
+        for (const CTxMemPool::txiter& added : sortedEntries) {
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(added);
+        }
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
 
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
@@ -289,21 +821,6 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
@@ -311,7 +828,6 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
         pblock->nTime = GetTime();
         const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
         CCoinsViewCache view(pcoinsTip);
@@ -319,243 +835,22 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         SaplingMerkleTree sapling_tree;
         assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
+        BlockAssembler assembler(chainparams, pblocktemplate.get(), view, pindexPrev, nLockTimeCutoff);
 
         // If we're given a coinbase tx, it's been precomputed, its fees are zero,
         // so we can't include any mempool transactions; this will be an empty block.
         if (!next_cb_mtx) {
-            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                mi != mempool.mapTx.end(); ++mi)
-            {
-                const CTransaction& tx = mi->GetTx();
-
-                int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                        ? nMedianTimePast
-                                        : pblock->GetBlockTime();
-
-                if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
-                    continue;
-
-                COrphan* porphan = NULL;
-                double dPriority = 0;
-                CAmount nTotalIn = 0;
-                bool fMissingInputs = false;
-                for (const CTxIn& txin : tx.vin)
-                {
-                    // Read prev transaction
-                    if (!view.HaveCoins(txin.prevout.hash))
-                    {
-                        // This should never happen; all transactions in the memory
-                        // pool should connect to either transactions in the chain
-                        // or other transactions in the memory pool.
-                        if (!mempool.mapTx.count(txin.prevout.hash))
-                        {
-                            LogPrintf("ERROR: mempool transaction missing input\n");
-                            if (fDebug) assert("mempool transaction missing input" == 0);
-                            fMissingInputs = true;
-                            if (porphan)
-                                vOrphan.pop_back();
-                            break;
-                        }
-
-                        // Has to wait for dependencies
-                        if (!porphan)
-                        {
-                            // Use list for automatic deletion
-                            vOrphan.push_back(COrphan(&tx));
-                            porphan = &vOrphan.back();
-                        }
-                        mapDependers[txin.prevout.hash].push_back(porphan);
-                        porphan->setDependsOn.insert(txin.prevout.hash);
-                        nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                        continue;
-                    }
-                    const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                    assert(coins);
-
-                    CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                    nTotalIn += nValueIn;
-
-                    int nConf = nHeight - coins->nHeight;
-
-                    dPriority += (double)nValueIn * nConf;
-                }
-                nTotalIn += tx.GetShieldedValueIn();
-
-                if (fMissingInputs) continue;
-
-                // Priority is sum(valuein * age) / modified_txsize
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-                dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-                uint256 hash = tx.GetHash();
-                mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-                CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-                if (porphan)
-                {
-                    porphan->dPriority = dPriority;
-                    porphan->feeRate = feeRate;
-                }
-                else
-                    vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
-            }
+            assembler.AddPriorityTxs();
+            assembler.AddPackageTxs();
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        // We want to track the value pool, but if the miner gets
-        // invoked on an old block before the hardcoded fallback
-        // is active we don't want to trip up any assertions. So,
-        // we only adhere to the turnstile (as a miner) if we
-        // actually have all of the information necessary to do
-        // so.
-        CAmount sproutValue = 0;
-        CAmount saplingValue = 0;
-        bool monitoring_pool_balances = true;
-        if (chainparams.ZIP209Enabled()) {
-            if (pindexPrev->nChainSproutValue) {
-                sproutValue = *pindexPrev->nChainSproutValue;
-            } else {
-                monitoring_pool_balances = false;
-            }
-            if (pindexPrev->nChainSaplingValue) {
-                saplingValue = *pindexPrev->nChainSaplingValue;
-            } else {
-                monitoring_pool_balances = false;
-            }
-        }
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
-                continue;
-
-            if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
-                // Does this transaction lead to a turnstile violation?
-
-                CAmount sproutValueDummy = sproutValue;
-                CAmount saplingValueDummy = saplingValue;
-
-                saplingValueDummy += -tx.valueBalance;
-
-                for (auto js : tx.vJoinSplit) {
-                    sproutValueDummy += js.vpub_old;
-                    sproutValueDummy -= js.vpub_new;
-                }
-
-                if (sproutValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
-                    continue;
-                }
-                if (saplingValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
-                    continue;
-                }
-
-                sproutValue = sproutValueDummy;
-                saplingValue = saplingValueDummy;
-            }
-
-            UpdateCoins(tx, view, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                for (COrphan* porphan : mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = assembler.GetBlockSize();
+        uint64_t nBlockTx = assembler.GetBlockTx();
+        nFees = assembler.GetFees();
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -610,6 +905,175 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
     return pblocktemplate.release();
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Background block template
+//
+
+static CCriticalSection cs_blockTemplate;
+static std::shared_ptr<const CBlockTemplate> pcachedTemplate;
+static MinerAddress cachedMinerAddress;
+static unsigned int nCachedTemplateTxUpdated = 0;
+// getblocktemplate handed out a template paying to cachedMinerAddress
+static bool fCachedAddressServed = false;
+static int64_t nLastTemplateRequest = 0;
+static int nLongPollWaiters = 0;
+static CAmount nLongPollFees = 0;
+static unsigned int nBlockTemplateLongPollId = 1;
+
+static void StoreBlockTemplate(std::shared_ptr<const CBlockTemplate> pblocktemplate, const MinerAddress& minerAddress, unsigned int nTransactionsUpdated, bool fServed)
+{
+    AssertLockHeld(cs_main);
+    const CAmount nFees = -pblocktemplate->vTxFees[0];
+    bool fNotify = false;
+    {
+        LOCK(cs_blockTemplate);
+        bool fNewTip = !pcachedTemplate || pcachedTemplate->block.hashPrevBlock != pblocktemplate->block.hashPrevBlock;
+        pcachedTemplate = pblocktemplate;
+        cachedMinerAddress = minerAddress;
+        nCachedTemplateTxUpdated = nTransactionsUpdated;
+        fCachedAddressServed = fServed;
+        if (fNewTip) {
+            // Longpolls are already woken by the tip change itself.
+            nLongPollFees = nFees;
+            nBlockTemplateLongPollId++;
+        } else if (nFees >= nLongPollFees + GetArg("-blocktemplatefeedelta", DEFAULT_BLOCK_TEMPLATE_FEE_DELTA)) {
+            nLongPollFees = nFees;
+            nBlockTemplateLongPollId++;
+            fNotify = true;
+        } else if (nFees < nLongPollFees) {
+            // Measure the next rise from here, e.g. after a conflict evicted fees.
+            nLongPollFees = nFees;
+        }
+    }
+    if (fNotify) {
+        LogPrint("mempool", "%s: template fees rose to %s, waking longpolls\n", __func__, FormatMoney(nFees));
+        cvBlockChange.notify_all();
+    }
+}
+
+static void UpdateCachedBlockTemplate(const CChainParams& chainparams)
+{
+    uint256 hashCachedPrev;
+    unsigned int nTxUpdated;
+    MinerAddress minerAddress;
+    bool fServed;
+    {
+        LOCK(cs_blockTemplate);
+        if (nLongPollWaiters == 0 && GetTime() - nLastTemplateRequest > BLOCK_TEMPLATE_IDLE_SECONDS) {
+            // Nobody is mining on these; the next request builds its own.
+            pcachedTemplate.reset();
+            cachedMinerAddress = MinerAddress();
+            return;
+        }
+        if (pcachedTemplate)
+            hashCachedPrev = pcachedTemplate->block.hashPrevBlock;
+        nTxUpdated = nCachedTemplateTxUpdated;
+        minerAddress = cachedMinerAddress;
+        fServed = fCachedAddressServed;
+    }
+
+    {
+        LOCK(cs_main);
+        if (pcoinsTip == NULL || chainActive.Tip() == NULL)
+            return;
+        if (chainActive.Tip()->GetBlockHash() == hashCachedPrev) {
+            if (mempool.GetTransactionsUpdated() == nTxUpdated)
+                return;
+        } else if (fServed || !std::visit(IsValidMinerAddress(), minerAddress)) {
+            // Pay each new block to a fresh address, as getblocktemplate
+            // would have done had it built the template itself; one that
+            // was never handed out can be used again.
+            MinerAddress freshAddress;
+            GetMainSignals().AddressForMining(freshAddress);
+            if (std::visit(IsValidMinerAddress(), freshAddress)) {
+                minerAddress = freshAddress;
+                fServed = false;
+            }
+        }
+        if (IsInitialBlockDownload(chainparams.GetConsensus()) || !std::visit(IsValidMinerAddress(), minerAddress))
+            return;
+
+        // Read the counter first, so that changes made while building
+        // trigger another rebuild.
+        nTxUpdated = mempool.GetTransactionsUpdated();
+        std::shared_ptr<const CBlockTemplate> pblocktemplate;
+        try {
+            pblocktemplate.reset(CreateNewBlock(chainparams, minerAddress));
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+            return;
+        }
+        if (!pblocktemplate)
+            return;
+        StoreBlockTemplate(pblocktemplate, minerAddress, nTxUpdated, fServed);
+    }
+}
+
+void ThreadBlockTemplateUpdater(const CChainParams& chainparams)
+{
+    const int64_t nInterval = std::max<int64_t>(GetArg("-blocktemplateinterval", DEFAULT_BLOCK_TEMPLATE_INTERVAL), 1);
+    while (true) {
+        {
+            // Tip changes wake us up immediately; mempool changes are
+            // picked up on the next interval.
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockChange.timed_wait(lock, boost::posix_time::milliseconds(nInterval));
+        }
+        boost::this_thread::interruption_point();
+        UpdateCachedBlockTemplate(chainparams);
+    }
+}
+
+bool GetCachedBlockTemplate(const CBlockIndex* pindexPrev, std::shared_ptr<const CBlockTemplate>& pblocktemplate, MinerAddress& minerAddress)
+{
+    LOCK(cs_blockTemplate);
+    nLastTemplateRequest = GetTime();
+    if (!pcachedTemplate || pcachedTemplate->block.hashPrevBlock != pindexPrev->GetBlockHash())
+        return false;
+    pblocktemplate = pcachedTemplate;
+    minerAddress = cachedMinerAddress;
+    fCachedAddressServed = true;
+    return true;
+}
+
+bool GetCachedBlockTemplateTxUpdated(const uint256& hashPrev, unsigned int& nTransactionsUpdated)
+{
+    LOCK(cs_blockTemplate);
+    if (!pcachedTemplate || pcachedTemplate->block.hashPrevBlock != hashPrev)
+        return false;
+    nTransactionsUpdated = nCachedTemplateTxUpdated;
+    return true;
+}
+
+void SetCachedBlockTemplate(std::shared_ptr<const CBlockTemplate> pblocktemplate, const MinerAddress& minerAddress, unsigned int nTransactionsUpdated)
+{
+    {
+        LOCK(cs_blockTemplate);
+        nLastTemplateRequest = GetTime();
+    }
+    StoreBlockTemplate(pblocktemplate, minerAddress, nTransactionsUpdated, true);
+}
+
+CBlockTemplateWaiter::CBlockTemplateWaiter()
+{
+    LOCK(cs_blockTemplate);
+    nLongPollWaiters++;
+}
+
+CBlockTemplateWaiter::~CBlockTemplateWaiter()
+{
+    LOCK(cs_blockTemplate);
+    nLongPollWaiters--;
+    nLastTemplateRequest = GetTime();
+}
+
+unsigned int GetBlockTemplateLongPollId()
+{
+    LOCK(cs_blockTemplate);
+    return nBlockTemplateLongPollId;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
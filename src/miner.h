@@ -9,6 +9,7 @@
 #include "primitives/block.h"
 
 #include <boost/shared_ptr.hpp>
+#include <memory>
 #include <stdint.h>
 #include <variant>
 
@@ -24,6 +25,13 @@ static const int DEFAULT_GENERATE_THREADS = 1;
 
 static const bool DEFAULT_PRINTPRIORITY = false;
 
+/** Default for -blocktemplateinterval, in milliseconds */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_INTERVAL = 1000;
+/** Default for -blocktemplatefeedelta, in zatoshis */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_FEE_DELTA = 10000;
+/** Drop the background template when getblocktemplate hasn't been called for this many seconds */
+static const int64_t BLOCK_TEMPLATE_IDLE_SECONDS = 120;
+
 class InvalidMinerAddress {
 public:
     friend bool operator==(const InvalidMinerAddress &a, const InvalidMinerAddress &b) { return true; }
@@ -77,6 +85,31 @@ CMutableTransaction CreateCoinbaseTransaction(const CChainParams& chainparams, C
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddress& minerAddress, const std::optional<CMutableTransaction>& next_coinbase_mtx = std::nullopt);
 
+/**
+ * Background block template maintenance. While getblocktemplate is being
+ * called or a longpoll waits, a template for the current tip is rebuilt
+ * off the RPC thread whenever the tip or the mempool changes, so requests
+ * are served from the latest one. The template is dropped once requests
+ * stop for BLOCK_TEMPLATE_IDLE_SECONDS.
+ */
+void ThreadBlockTemplateUpdater(const CChainParams& chainparams);
+/** Return the latest background template if it builds on pindexPrev, along with the address its coinbase pays to */
+bool GetCachedBlockTemplate(const CBlockIndex* pindexPrev, std::shared_ptr<const CBlockTemplate>& pblocktemplate, MinerAddress& minerAddress);
+/** The mempool counter the latest template was built at, if it builds on hashPrev */
+bool GetCachedBlockTemplateTxUpdated(const uint256& hashPrev, unsigned int& nTransactionsUpdated);
+/** Store a template built and served on the caller's thread; nTransactionsUpdated is the mempool counter read before building it. cs_main must be held. */
+void SetCachedBlockTemplate(std::shared_ptr<const CBlockTemplate> pblocktemplate, const MinerAddress& minerAddress, unsigned int nTransactionsUpdated);
+
+/** Held by a getblocktemplate longpoll while it waits */
+class CBlockTemplateWaiter
+{
+public:
+    CBlockTemplateWaiter();
+    ~CBlockTemplateWaiter();
+};
+/** Changes whenever the tip changes or the template's fees rise by -blocktemplatefeedelta; used as the getblocktemplate longpoll id */
+unsigned int GetBlockTemplateLongPollId();
+
 #ifdef ENABLE_MINING
 /** Get -mineraddress */
 void GetMinerAddress(MinerAddress &minerAddress);
@@ -79,6 +79,8 @@ static std::vector<ListenSocket> vhListenSocket;
 static list<CNode*> vNodesDisconnected;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+SocketEventsMode nSocketEventsMode = DEFAULT_SOCKETEVENTS;
+int nMessageHandlerThreads = DEFAULT_MSGHANDLER_THREADS;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -104,10 +106,192 @@ CCriticalSection cs_nLastNodeId;
 static CSemaphore *semOutbound = NULL;
 static boost::condition_variable messageHandlerCondition;
 
+// Peers waiting for a message handler worker, with whether they may trickle
+static std::deque<std::pair<CNode*, bool> > vMessageWork;
+static boost::mutex mutexMessageWork;
+static boost::condition_variable condMessageWork;
+// Set by a worker that left messages behind when a peer's turn ran out
+static std::atomic<bool> fMessageWorkPending(false);
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+//
+// Socket events
+//
+// ThreadSocketHandler waits for readiness with select(), poll() or epoll.
+// Under epoll every socket is registered once, edge-triggered, and the
+// readiness it reports is kept in CNode::fHasRecvData/fCanSendData until a
+// recv() or send() would block, so a wake-up makes no system call for idle
+// peers.
+//
+
+/** select() wait, which also bounds how soon queued send data is noticed */
+static const int SELECT_TIMEOUT_MILLISECONDS = 50;
+/** Upper bound on a poll()/epoll wait; readiness or WakeSocketHandler() normally ends it sooner */
+static const int SOCKET_EVENTS_MAX_WAIT_MILLISECONDS = 1000;
+/** Maximum number of epoll events taken per wait */
+static const int MAX_EPOLL_EVENTS = 1024;
+
+#ifdef USE_POLL
+static int wakeupPipe[2] = {-1, -1};
+static std::atomic<bool> fWakeupPending(false);
+#endif
+#ifdef USE_EPOLL
+static int epollfd = -1;
+#endif
+
+std::string SocketEventsModeToString(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT: return "select";
+    case SOCKETEVENTS_POLL:   return "poll";
+    case SOCKETEVENTS_EPOLL:  return "epoll";
+    }
+    return "unknown";
+}
+
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef USE_POLL
+    if (str == "poll") {
+        mode = SOCKETEVENTS_POLL;
+        return true;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (str == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+    std::string strModes = "select";
+#ifdef USE_POLL
+    strModes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    strModes += ", epoll";
+#endif
+    return strModes;
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_POLL
+    if (wakeupPipe[1] == -1 || fWakeupPending.exchange(true))
+        return;
+    char buf = 0;
+    if (write(wakeupPipe[1], &buf, 1) != 1)
+        LogPrint("net", "write to socket handler wakeup pipe failed\n");
+#endif
+}
+
+#ifdef USE_POLL
+static void DrainWakeupPipe()
+{
+    fWakeupPending = false;
+    char buf[128];
+    while (read(wakeupPipe[0], buf, sizeof(buf)) > 0) {}
+}
+#endif
+
+/** Set up the wakeup pipe and the epoll instance, registering the listen sockets */
+static void InitSocketEvents()
+{
+#ifdef USE_POLL
+    if (nSocketEventsMode != SOCKETEVENTS_SELECT && wakeupPipe[0] == -1) {
+        if (pipe(wakeupPipe) != 0) {
+            LogPrintf("Could not create socket handler wakeup pipe: %s\n", NetworkErrorString(errno));
+            wakeupPipe[0] = wakeupPipe[1] = -1;
+        } else {
+            for (int fd : wakeupPipe)
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+#endif
+#ifdef USE_EPOLL
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && epollfd == -1) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1) {
+            LogPrintf("epoll_create1 failed (%s), falling back to poll\n", NetworkErrorString(errno));
+            nSocketEventsMode = SOCKETEVENTS_POLL;
+            return;
+        }
+        // Listen sockets and the wakeup pipe are level-triggered: one
+        // accept() or drain per wake-up is enough.
+        for (ListenSocket& hListenSocket : vhListenSocket) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for listen socket: %s\n", NetworkErrorString(errno));
+        }
+        if (wakeupPipe[0] != -1) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = wakeupPipe;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeupPipe[0], &event) != 0)
+                LogPrintf("epoll_ctl failed for wakeup pipe: %s\n", NetworkErrorString(errno));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", SocketEventsModeToString(nSocketEventsMode));
+}
+
+static void ShutdownSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        close(epollfd);
+        epollfd = -1;
+    }
+#endif
+#ifdef USE_POLL
+    for (int& fd : wakeupPipe) {
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+/** Start watching a new node's socket; nodes are only deleted by ThreadSocketHandler, so the pointer stays valid */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = pnode;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+            LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+            pnode->fDisconnect = true;
+        }
+        return;
+    }
+#endif
+    // poll() and select() build their sets from vNodes on the next round
+    WakeSocketHandler();
+}
+
+static void UnregisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (epollfd != -1)
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, pnode->hSocket, NULL);
+#endif
+}
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -324,6 +508,9 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgStats;
+mapMsgCmdStats CNode::mapTotalMsgStats;
+CQueueWaitHistogram CNode::queueWaitHistogram;
 
 uint64_t CNode::nMaxOutboundLimit = 0;
 uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
@@ -427,6 +614,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool obfuScationMa
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
 
@@ -487,6 +675,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        UnregisterNodeSocket(this);
         CloseSocket(hSocket);
     }
 
@@ -694,6 +883,10 @@ void CNode::copyStats(CNodeStats &stats)
     stats.nSendBytes = nSendBytes;
     stats.nRecvBytes = nRecvBytes;
     stats.fWhitelisted = fWhitelisted;
+    {
+        LOCK(cs_msgStats);
+        stats.mapMsgStats = mapMsgStats;
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -746,6 +939,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            RecordMsgRecv(msg.hdr.GetCommand(), msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE);
             messageHandlerCondition.notify_one();
         }
     }
@@ -753,6 +947,75 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+CRecvBufferPool recvBufferPool;
+
+CRecvBufferPool::CRecvBufferPool() : vFree(SizeClass(MAX_PROTOCOL_MESSAGE_LENGTH) + 1), nPooledBytes(0)
+{
+}
+
+unsigned int CRecvBufferPool::SizeClass(size_t nSize)
+{
+    // Largest class whose size does not exceed nSize
+    unsigned int nClass = 0;
+    while ((RECV_BUFFER_POOL_MIN_SIZE << (nClass + 1)) <= nSize)
+        nClass++;
+    return nClass;
+}
+
+bool CRecvBufferPool::Get(size_t nSize, CDataStream& stream)
+{
+    if (nSize < RECV_BUFFER_POOL_MIN_SIZE || nSize > MAX_PROTOCOL_MESSAGE_LENGTH)
+        return false;
+
+    LOCK(cs);
+    // Classes round down, so only part of nSize's own class is big enough
+    for (unsigned int i = SizeClass(nSize); i < vFree.size(); i++) {
+        std::vector<CSerializeData>& vBuffers = vFree[i];
+        for (size_t j = vBuffers.size(); j-- > 0; ) {
+            if (vBuffers[j].capacity() < nSize)
+                continue;
+            nPooledBytes -= vBuffers[j].capacity();
+            stream.clear();
+            stream.swap(vBuffers[j]);
+            vBuffers[j].swap(vBuffers.back());
+            vBuffers.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void CRecvBufferPool::Put(CDataStream& stream)
+{
+    // Account for the whole buffer, not just what follows the stream's read position
+    CSerializeData vch;
+    stream.swap(vch);
+    vch.clear();
+    size_t nCapacity = vch.capacity();
+    if (nCapacity < RECV_BUFFER_POOL_MIN_SIZE || nCapacity > MAX_PROTOCOL_MESSAGE_LENGTH)
+        return;
+
+    LOCK(cs);
+    if (nPooledBytes + nCapacity > RECV_BUFFER_POOL_MAX_BYTES)
+        return;
+    nPooledBytes += nCapacity;
+    vFree[SizeClass(nCapacity)].push_back(std::move(vch));
+}
+
+size_t CRecvBufferPool::GetPooledBytes() const
+{
+    LOCK(cs);
+    return nPooledBytes;
+}
+
+const uint256& CNetMessage::GetMessageHash() const
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -781,6 +1044,11 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Take a buffer for the whole payload from the pool. A fresh one starts at
+    // no more than 256 KiB, so a header alone cannot make us allocate 2 MiB.
+    if (hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH && !recvBufferPool.Get(hdr.nMessageSize, vRecv))
+        vRecv.reserve(std::min(hdr.nMessageSize, (unsigned int)(256 * 1024)));
+
     return nCopy;
 }
 
@@ -789,12 +1057,13 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    if (vRecv.capacity() < nDataPos + nCopy) {
+        // Grow geometrically, but never past the total message size.
+        vRecv.reserve(std::min((size_t)hdr.nMessageSize, std::max((size_t)nDataPos + nCopy, 2 * vRecv.capacity())));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    hasher.Write((const unsigned char*)pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -828,6 +1097,7 @@ void SocketSendData(CNode *pnode)
                 it++;
             } else {
                 // could not send full message; stop sending more
+                pnode->fCanSendData = false;
                 break;
             }
         } else {
@@ -839,6 +1109,8 @@ void SocketSendData(CNode *pnode)
                     LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
                     pnode->CloseSocketDisconnect();
                 }
+                else
+                    pnode->fCanSendData = false;
             }
             // couldn't send anything at all
             break;
@@ -1125,11 +1397,215 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    RegisterNodeSocket(pnode);
+}
+
+/** Whether we should read more from a node's socket; requires LOCK(pnode->cs_vRecvMsg) */
+static bool NodeWantsRecv(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void SocketEventsSelect(const std::vector<CNode*>& vNodesCopy, int nTimeoutMs, std::vector<const ListenSocket*>& vListenReady)
+{
+    struct timeval timeout = MillisToTimeval(nTimeoutMs);
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    for (CNode* pnode : vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+#ifndef WIN32
+        // Builds with poll() accept descriptors select() cannot watch
+        if (pnode->hSocket >= FD_SETSIZE) {
+            LogPrintf("peer=%d socket is not selectable, disconnecting\n", pnode->id);
+            pnode->fDisconnect = true;
+            continue;
+        }
+#endif
+        FD_SET(pnode->hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, pnode->hSocket);
+        have_fds = true;
+
+        // Implement the following logic:
+        // * If there is data to send, select() for sending data. As this only
+        //   happens when optimistic write failed, we choose to first drain the
+        //   write buffer in this case before receiving more. This avoids
+        //   needlessly queueing received data, if the remote peer is not themselves
+        //   receiving data. This means properly utilizing TCP flow control signaling.
+        // * Otherwise, if there is no (complete) message in the receive buffer,
+        //   or there is space left in the buffer, select() for receiving data.
+        // * (if neither of the above applies, there is certainly one message
+        //   in the receiver buffer ready to be processed).
+        // Together, that means that at least one of the following is always possible,
+        // so we don't deadlock:
+        // * We send some data.
+        // * We wait for data to be received (and disconnect after timeout).
+        // * We process a message in the buffer (message handler thread).
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty()) {
+                FD_SET(pnode->hSocket, &fdsetSend);
+                continue;
+            }
+        }
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && NodeWantsRecv(pnode))
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(nTimeoutMs);
+    }
+
+    for (const ListenSocket& hListenSocket : vhListenSocket)
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            vListenReady.push_back(&hListenSocket);
+
+    for (CNode* pnode : vNodesCopy)
+    {
+        SOCKET hSocket = pnode->hSocket;
+        bool fSelectable = hSocket != INVALID_SOCKET;
+#ifndef WIN32
+        fSelectable = fSelectable && hSocket < FD_SETSIZE;
+#endif
+        pnode->fHasRecvData = fSelectable && (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError));
+        pnode->fCanSendData = fSelectable && FD_ISSET(hSocket, &fdsetSend);
+    }
+}
+
+#ifdef USE_POLL
+static void SocketEventsPoll(const std::vector<CNode*>& vNodesCopy, int nTimeoutMs, std::vector<const ListenSocket*>& vListenReady)
+{
+    std::vector<struct pollfd> vPollFds;
+    vPollFds.reserve(1 + vhListenSocket.size() + vNodesCopy.size());
+
+    struct pollfd pollfd = {};
+    pollfd.fd = wakeupPipe[0];
+    pollfd.events = POLLIN;
+    vPollFds.push_back(pollfd);
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        pollfd.fd = hListenSocket.socket;
+        vPollFds.push_back(pollfd);
+    }
+    // Same interest as with select(): drain pending sends before reading more
+    size_t nFirstNode = vPollFds.size();
+    for (CNode* pnode : vNodesCopy) {
+        pollfd.fd = pnode->hSocket == INVALID_SOCKET ? -1 : pnode->hSocket;
+        pollfd.events = 0;
+        if (pollfd.fd != -1) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty())
+                pollfd.events = POLLOUT;
+        }
+        if (pollfd.fd != -1 && pollfd.events == 0) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && NodeWantsRecv(pnode))
+                pollfd.events = POLLIN;
+        }
+        vPollFds.push_back(pollfd);
+    }
+
+    if (poll(vPollFds.data(), vPollFds.size(), nTimeoutMs) < 0) {
+        if (errno != EINTR)
+            LogPrintf("socket poll error %s\n", NetworkErrorString(errno));
+        for (CNode* pnode : vNodesCopy)
+            pnode->fHasRecvData = pnode->fCanSendData = false;
+        MilliSleep(SELECT_TIMEOUT_MILLISECONDS);
+        return;
+    }
+    boost::this_thread::interruption_point();
+
+    if (vPollFds[0].revents)
+        DrainWakeupPipe();
+    for (size_t i = 0; i < vhListenSocket.size(); i++)
+        if (vPollFds[1 + i].revents & POLLIN)
+            vListenReady.push_back(&vhListenSocket[i]);
+    for (size_t i = 0; i < vNodesCopy.size(); i++) {
+        short revents = vPollFds[nFirstNode + i].revents;
+        vNodesCopy[i]->fHasRecvData = (revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+        vNodesCopy[i]->fCanSendData = (revents & POLLOUT) != 0;
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+static void SocketEventsEpoll(int nTimeoutMs, std::vector<const ListenSocket*>& vListenReady)
+{
+    epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, nTimeoutMs);
+    if (nEvents < 0) {
+        if (errno != EINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        MilliSleep(SELECT_TIMEOUT_MILLISECONDS);
+        return;
+    }
+    boost::this_thread::interruption_point();
+
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == wakeupPipe) {
+            DrainWakeupPipe();
+            continue;
+        }
+        bool fListen = false;
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            if (ptr == &hListenSocket) {
+                vListenReady.push_back(&hListenSocket);
+                fListen = true;
+                break;
+            }
+        }
+        if (fListen)
+            continue;
+
+        // Readiness is only ever set here; it is cleared by the recv()/send()
+        // that finds the socket drained or full.
+        CNode* pnode = static_cast<CNode*>(ptr);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            pnode->fHasRecvData = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fCanSendData = true;
+    }
 }
+#endif
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    int nWaitMs = 0;
     while (true)
     {
         //
@@ -1203,112 +1679,61 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for socket readiness
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signaling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            vNodesCopy = vNodes;
+            for (CNode* pnode : vNodesCopy)
+                pnode->AddRef();
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+        vector<const ListenSocket*> vListenReady;
+        switch (nSocketEventsMode) {
+#ifdef USE_EPOLL
+        case SOCKETEVENTS_EPOLL:
+            SocketEventsEpoll(nWaitMs, vListenReady);
+            break;
+#endif
+#ifdef USE_POLL
+        case SOCKETEVENTS_POLL:
+            SocketEventsPoll(vNodesCopy, nWaitMs, vListenReady);
+            break;
+#endif
+        default:
+            SocketEventsSelect(vNodesCopy, nWaitMs, vListenReady);
+            break;
         }
 
         //
         // Accept new connections
         //
-        for (const ListenSocket& hListenSocket : vhListenSocket)
-        {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
-            }
-        }
+        for (const ListenSocket* pListenSocket : vListenReady)
+            AcceptConnection(*pListenSocket);
 
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
-                pnode->AddRef();
-        }
+        // Nodes that still have unread data (a full buffer was read) are
+        // revisited without waiting; nodes whose buffers were locked by the
+        // message handler are retried after a short wait.
+        bool fMoreData = false;
+        bool fBusy = false;
+        int64_t nTime = GetTime();
+        bool fCheckInactivity = nTime != nLastInactivityCheck;
+        nLastInactivityCheck = nTime;
         for (CNode* pnode : vNodesCopy)
         {
             boost::this_thread::interruption_point();
 
+            // Readiness is a hint: a writable edge racing with the message
+            // handler's own partial send can leave it unset, so queued data is
+            // also retried on each inactivity check.
+            bool fSendPending = pnode->nSendSize > 0 && (pnode->fCanSendData || fCheckInactivity);
+            if (!pnode->fHasRecvData && !fSendPending && !fCheckInactivity)
+                continue;
+
             auto spanGuard = pnode->span.Enter();
 
             //
@@ -1316,10 +1741,12 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fHasRecvData)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!lockRecv)
+                    fBusy = true;
+                else if (NodeWantsRecv(pnode))
                 {
                     {
                         // typical socket buffer is 8K-64K
@@ -1332,6 +1759,11 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // A short read drained the socket; more data raises a new event
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fHasRecvData = false;
+                            else
+                                fMoreData = true;
                         }
                         else if (nBytes == 0)
                         {
@@ -1350,6 +1782,8 @@ void ThreadSocketHandler()
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                                 pnode->CloseSocketDisconnect();
                             }
+                            else if (nErr == WSAEWOULDBLOCK)
+                                pnode->fHasRecvData = false;
                         }
                     }
                 }
@@ -1360,18 +1794,19 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (fSendPending)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (!lockSend)
+                    fBusy = true;
+                else if (!pnode->vSendMsg.empty())
                     SocketSendData(pnode);
             }
 
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            if (fCheckInactivity && nTime - pnode->nTimeConnected > 60)
             {
                 if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
                 {
@@ -1400,10 +1835,18 @@ void ThreadSocketHandler()
             for (CNode* pnode : vNodesCopy)
                 pnode->Release();
         }
+
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+            nWaitMs = fMoreData ? 0 : SELECT_TIMEOUT_MILLISECONDS;
+        else if (fMoreData)
+            nWaitMs = 0;
+        else if (fBusy)
+            nWaitMs = SELECT_TIMEOUT_MILLISECONDS;
+        else
+            nWaitMs = SOCKET_EVENTS_MAX_WAIT_MILLISECONDS;
     }
 }
 
-
 void ThreadDNSAddressSeed()
 {
     // goal: only query DNS seeds if address need is acute
@@ -1694,73 +2137,124 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Give a peer one turn: process up to MAX_MESSAGES_PER_PEER_TURN of its
+ * received messages, stopping early after MAX_PEER_TURN_MICROS, then let it
+ * send. Returns whether it still has work waiting.
+ */
+static bool ServeNodeMessages(const CChainParams& chainparams, CNode* pnode, bool fSendTrickle)
+{
+    auto spanGuard = pnode->span.Enter();
+    bool fMoreWork = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            bool fRecvPaused = !NodeWantsRecv(pnode);
+            int64_t nTurnEnd = GetTimeMicros() + MAX_PEER_TURN_MICROS;
+            for (unsigned int nMessages = 0; nMessages < MAX_MESSAGES_PER_PEER_TURN && !pnode->fDisconnect; nMessages++)
+            {
+                if (!g_signals.ProcessMessages(chainparams, pnode)) {
+                    pnode->CloseSocketDisconnect();
+                    fMoreWork = false;
+                    break;
+                }
+                fMoreWork = pnode->nSendSize < SendBufferSize() &&
+                    (!pnode->vRecvGetData.empty() || !pnode->setOrphanWork.empty() ||
+                     (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()));
+                if (!fMoreWork || GetTimeMicros() > nTurnEnd)
+                    break;
+            }
+            // The socket handler stopped reading while the receive buffer was full
+            if (fRecvPaused && NodeWantsRecv(pnode))
+                WakeSocketHandler();
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(chainparams.GetConsensus(), pnode, fSendTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMoreWork;
+}
+
+void ThreadMessageWorker()
 {
     const CChainParams& chainparams = Params();
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
 
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        vector<CNode*> vNodesCopy;
+        std::pair<CNode*, bool> work;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
-            }
+            boost::unique_lock<boost::mutex> lock(mutexMessageWork);
+            while (vMessageWork.empty())
+                condMessageWork.wait(lock);
+            work = vMessageWork.front();
+            vMessageWork.pop_front();
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
-        bool fSleep = true;
+        CNode* pnode = work.first;
+        bool fMoreWork = !pnode->fDisconnect && ServeNodeMessages(chainparams, pnode, work.second);
 
-        for (CNode* pnode : vNodesCopy)
+        // Clear the flag before reporting more work, so the next pass of
+        // ThreadMessageHandler is free to queue the peer again
+        pnode->fMessageWorkQueued = false;
         {
-            if (pnode->fDisconnect)
-                continue;
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        if (fMoreWork) {
+            fMessageWorkPending = true;
+            messageHandlerCondition.notify_one();
+        }
+    }
+}
 
-            auto spanGuard = pnode->span.Enter();
+void ThreadMessageHandler()
+{
+    boost::mutex condition_mutex;
+    boost::unique_lock<boost::mutex> lock(condition_mutex);
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(chainparams, pnode))
-                        pnode->CloseSocketDisconnect();
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        fMessageWorkPending = false;
 
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
+        // Queue every peer that is not already queued or being served. Peers
+        // are served in FIFO order, one turn at a time, so a peer with a
+        // long backlog cannot hold the workers while others wait.
+        std::vector<std::pair<CNode*, bool> > vWork;
+        {
+            LOCK(cs_vNodes);
+            CNode* pnodeTrickle = NULL;
+            if (!vNodes.empty())
+                pnodeTrickle = vNodes[GetRand(vNodes.size())];
+            for (CNode* pnode : vNodes) {
+                if (pnode->fDisconnect || pnode->fMessageWorkQueued.exchange(true))
+                    continue;
+                pnode->AddRef();
+                vWork.push_back(std::make_pair(pnode, pnode == pnodeTrickle || pnode->fWhitelisted));
             }
-            boost::this_thread::interruption_point();
+        }
 
-            // Send messages
+        if (!vWork.empty()) {
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(chainparams.GetConsensus(), pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                boost::unique_lock<boost::mutex> lockWork(mutexMessageWork);
+                vMessageWork.insert(vMessageWork.end(), vWork.begin(), vWork.end());
             }
-            boost::this_thread::interruption_point();
-        }
-
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
+            condMessageWork.notify_all();
         }
+        boost::this_thread::interruption_point();
 
-        if (fSleep)
+        if (!fMessageWorkPending)
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
@@ -1978,6 +2472,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
         threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "dnsseed", &ThreadDNSAddressSeed));
 
     // Send and receive from sockets, accept connections
+    InitSocketEvents();
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1989,6 +2484,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2033,6 +2530,7 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        ShutdownSocketEvents();
         vhListenSocket.clear();
         delete semOutbound;
         semOutbound = NULL;
@@ -2093,6 +2591,11 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
@@ -2227,6 +2730,107 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+mapMsgCmdStats::iterator CNode::FindMsgStats(mapMsgCmdStats& mapStats, const std::string& strCommand)
+{
+    // Fill in every known command up front, so peers sending garbage
+    // commands cannot grow the map.
+    if (mapStats.empty()) {
+        for (const std::string& strType : getAllNetMessageTypes())
+            mapStats[strType];
+        mapStats[NET_MESSAGE_COMMAND_OTHER];
+    }
+    mapMsgCmdStats::iterator it = mapStats.find(strCommand);
+    if (it == mapStats.end())
+        it = mapStats.find(NET_MESSAGE_COMMAND_OTHER);
+    return it;
+}
+
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CMsgCmdStats& stats = FindMsgStats(mapMsgStats, strCommand)->second;
+        stats.nSendBytes += nBytes;
+        stats.nSendCount++;
+    }
+    LOCK(cs_totalMsgStats);
+    CMsgCmdStats& stats = FindMsgStats(mapTotalMsgStats, strCommand)->second;
+    stats.nSendBytes += nBytes;
+    stats.nSendCount++;
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CMsgCmdStats& stats = FindMsgStats(mapMsgStats, strCommand)->second;
+        stats.nRecvBytes += nBytes;
+        stats.nRecvCount++;
+    }
+    LOCK(cs_totalMsgStats);
+    CMsgCmdStats& stats = FindMsgStats(mapTotalMsgStats, strCommand)->second;
+    stats.nRecvBytes += nBytes;
+    stats.nRecvCount++;
+}
+
+void CNode::RecordMsgProcessed(const std::string& strCommand, int64_t nProcessMicros, int64_t nQueueMicros)
+{
+    queueWaitHistogram.Add(nQueueMicros);
+    {
+        LOCK(cs_msgStats);
+        CMsgCmdStats& stats = FindMsgStats(mapMsgStats, strCommand)->second;
+        stats.nProcessMicros += nProcessMicros;
+        stats.nQueueMicros += nQueueMicros;
+    }
+    LOCK(cs_totalMsgStats);
+    CMsgCmdStats& stats = FindMsgStats(mapTotalMsgStats, strCommand)->second;
+    stats.nProcessMicros += nProcessMicros;
+    stats.nQueueMicros += nQueueMicros;
+}
+
+mapMsgCmdStats CNode::GetTotalMsgStats()
+{
+    LOCK(cs_totalMsgStats);
+    return mapTotalMsgStats;
+}
+
+void CNode::GetQueueWaitHistogram(std::vector<uint64_t>& vCounts, uint64_t& nTotalMicros)
+{
+    queueWaitHistogram.GetCounts(vCounts, nTotalMicros);
+}
+
+CQueueWaitHistogram::CQueueWaitHistogram() : nTotalMicros(0)
+{
+    for (unsigned int i = 0; i < BUCKETS; i++)
+        vCount[i] = 0;
+}
+
+void CQueueWaitHistogram::Add(int64_t nWaitMicros)
+{
+    if (nWaitMicros < 0)
+        nWaitMicros = 0;
+    unsigned int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && nWaitMicros >= BucketLimitMillis(nBucket) * 1000)
+        nBucket++;
+    vCount[nBucket]++;
+    nTotalMicros += nWaitMicros;
+}
+
+void CQueueWaitHistogram::GetCounts(std::vector<uint64_t>& vCounts, uint64_t& nTotalMicrosOut) const
+{
+    vCounts.resize(BUCKETS);
+    for (unsigned int i = 0; i < BUCKETS; i++)
+        vCounts[i] = vCount[i];
+    nTotalMicrosOut = nTotalMicros;
+}
+
+int64_t CQueueWaitHistogram::BucketLimitMillis(unsigned int i)
+{
+    if (i >= BUCKETS - 1)
+        return -1;
+    return int64_t(1) << i;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2270,7 +2874,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     addr(addrIn),
     nKeyedNetGroup(CalculateKeyedNetGroup(addrIn)),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    alertKnown(100, 0.000001),
+    filterInventoryKnown(20000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2291,6 +2896,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fHasRecvData = false;
+    fCanSendData = false;
+    fMessageWorkQueued = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2306,6 +2914,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fPingQueued = false;
     fObfuScationMaster = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    minFeeFilter = 0;
+    lastSentFeeFilter = 0;
+    nextSendTimeFeeFilter = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2430,13 +3041,20 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    const char* pchCommand = (const char*)&ssSend[MESSAGE_START_SIZE];
+    RecordMsgSent(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
+
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // poll() only watches for writability when there is data queued
+        if (!vSendMsg.empty() && nSocketEventsMode == SOCKETEVENTS_POLL)
+            WakeSocketHandler();
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
@@ -7,11 +7,12 @@
 #define BITCOIN_NET_H
 
 #include "addrdb.h"
+#include "amount.h"
 #include "bloom.h"
 #include "compat.h"
 #include "fs.h"
+#include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -21,6 +22,7 @@
 #include "utilstrencodings.h"
 #include "chainparams.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -73,6 +75,29 @@ static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 2 * 1000; // old defaut is 1 * 1000; can be changed by using -maxsendbuffer 
 
+/** How ThreadSocketHandler waits for socket readiness, see -socketevents */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_POLL,
+    SOCKETEVENTS_EPOLL,
+};
+#if defined(USE_EPOLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_EPOLL;
+#elif defined(USE_POLL)
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_POLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKETEVENTS = SOCKETEVENTS_SELECT;
+#endif
+
+/** Default number of threads running ProcessMessages/SendMessages, see -msghandlerthreads */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Upper bound on -msghandlerthreads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** Messages processed for one peer before the worker moves on to the next queued peer */
+static const unsigned int MAX_MESSAGES_PER_PEER_TURN = 8;
+/** Time after which a peer's turn ends even if it has more messages waiting (in microseconds) */
+static const int64_t MAX_PEER_TURN_MICROS = 20 * 1000;
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -93,6 +118,12 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Interrupt the socket handler's wait so it picks up new send data or a new node */
+void WakeSocketHandler();
+std::string SocketEventsModeToString(SocketEventsMode mode);
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode);
+/** Comma separated list of the -socketevents modes compiled in */
+std::string GetSupportedSocketEventsModes();
 
 typedef int NodeId;
 
@@ -160,6 +191,8 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -185,6 +218,44 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing cost of one message command, per peer or in total */
+struct CMsgCmdStats
+{
+    uint64_t nSendBytes = 0;
+    uint64_t nSendCount = 0;
+    uint64_t nRecvBytes = 0;
+    uint64_t nRecvCount = 0;
+    //! Time spent in ProcessMessage handling this command
+    int64_t nProcessMicros = 0;
+    //! Time these messages sat complete in vRecvMsg before being handled
+    int64_t nQueueMicros = 0;
+};
+
+/** Keyed by command; unknown commands are folded into NET_MESSAGE_COMMAND_OTHER */
+typedef std::map<std::string, CMsgCmdStats> mapMsgCmdStats;
+
+/**
+ * How long complete messages waited in a peer's receive queue before
+ * ProcessMessages got to them. Bucket i counts waits shorter than 2^i ms
+ * (and at least 2^(i-1) ms); the last bucket also takes everything longer.
+ */
+class CQueueWaitHistogram
+{
+public:
+    static const unsigned int BUCKETS = 16;
+
+    CQueueWaitHistogram();
+
+    void Add(int64_t nWaitMicros);
+    void GetCounts(std::vector<uint64_t>& vCounts, uint64_t& nTotalMicros) const;
+    /** Exclusive upper bound of bucket i in milliseconds, or -1 for the last one */
+    static int64_t BucketLimitMillis(unsigned int i);
+
+private:
+    std::atomic<uint64_t> vCount[BUCKETS];
+    std::atomic<uint64_t> nTotalMicros;
+};
+
 class CNodeStats
 {
 public:
@@ -205,12 +276,50 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgCmdStats mapMsgStats;
 };
 
 
 
 
+/**
+ * Recycles the payload buffers of received messages. Buffers are kept in
+ * power-of-two size classes from RECV_BUFFER_POOL_MIN_SIZE up to
+ * MAX_PROTOCOL_MESSAGE_LENGTH, so a message can take a buffer big enough for
+ * its whole payload as soon as its header is parsed, instead of growing and
+ * copying a fresh one for every block a peer sends.
+ */
+class CRecvBufferPool
+{
+public:
+    /** Smallest buffer worth pooling */
+    static const size_t RECV_BUFFER_POOL_MIN_SIZE = 4 * 1024;
+    /** Total capacity of the buffers kept for reuse */
+    static const size_t RECV_BUFFER_POOL_MAX_BYTES = 16 * 1024 * 1024;
+
+    CRecvBufferPool();
+
+    /** Give an empty stream a pooled buffer of at least nSize bytes capacity, if there is one */
+    bool Get(size_t nSize, CDataStream& stream);
+    /** Take back the buffer of a stream that is no longer needed; it is freed if the pool is full */
+    void Put(CDataStream& stream);
+
+    size_t GetPooledBytes() const;
+
+private:
+    static unsigned int SizeClass(size_t nSize);
+
+    mutable CCriticalSection cs;
+    std::vector<std::vector<CSerializeData> > vFree; // indexed by SizeClass
+    size_t nPooledBytes;
+};
+
+extern CRecvBufferPool recvBufferPool;
+
 class CNetMessage {
+private:
+    mutable CHash256 hasher;
+    mutable uint256 data_hash;
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
@@ -222,6 +331,7 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    bool fPrechecked;               // signatures already handed to the gossip check queue
 
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
@@ -229,6 +339,15 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        fPrechecked = false;
+    }
+
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+
+    ~CNetMessage()
+    {
+        recvBufferPool.Put(vRecv);
     }
 
     bool complete() const
@@ -238,6 +357,9 @@ public:
         return (hdr.nMessageSize == nDataPos);
     }
 
+    /** Double SHA256 of the payload, computed as it arrived. Requires complete(). */
+    const uint256& GetMessageHash() const;
+
     void SetVersion(int nVersionIn)
     {
         hdrbuf.SetVersion(nVersionIn);
@@ -264,6 +386,9 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // Orphan transactions to reconsider now that this peer provided a parent.
+    // Only touched by the message handler thread, with cs_main held.
+    std::set<uint256> setOrphanWork;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -289,6 +414,13 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     std::atomic_bool fDisconnect;
+    // Readiness last reported by the socket engine. With edge-triggered epoll
+    // these stay set until a recv() or send() on the socket would block.
+    std::atomic_bool fHasRecvData;
+    std::atomic_bool fCanSendData;
+    // Set while the peer waits in, or is being served from, the message
+    // handler work queue. Keeps its messages processed by one worker at a time.
+    std::atomic_bool fMessageWorkQueued;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -335,15 +467,22 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay; other peers' message handlers push addresses to us, so
+    // vAddrToSend and addrKnown are guarded by cs_addrSend
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addrSend;
     bool fGetAddr;
-    std::set<uint256> setKnown;
+    CRollingBloomFilter alertKnown;
 
-    // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // inventory based relay, keyed on the hash with the inv type mixed in so
+    // a tx and its lock request or dstx under the same hash are tracked apart
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // List of block ids we still have to announce.
+    // There is no final sorting before sending, as they are always sent immediately
+    // and in the order requested.
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -359,6 +498,17 @@ public:
     int64_t nMinPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
+    // Minimum fee rate (zatoshis per 1000 bytes) of transactions the peer
+    // wants announced to it, as set by its last "feefilter".
+    CAmount minFeeFilter;
+    CCriticalSection cs_feeFilter;
+    // Our own fee filter as last sent to this peer, and when to reconsider it.
+    CAmount lastSentFeeFilter;
+    int64_t nextSendTimeFeeFilter;
+
+    // Per-command traffic and processing time for this peer
+    CCriticalSection cs_msgStats;
+    mapMsgCmdStats mapMsgStats;
 
     CNode(SOCKET hSocketIn, const CAddress &addrIn, const std::string &addrNameIn = "", bool fInboundIn = false);
     ~CNode();
@@ -370,6 +520,13 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Per-command totals over all peers, and the receive queue wait histogram
+    static CCriticalSection cs_totalMsgStats;
+    static mapMsgCmdStats mapTotalMsgStats;
+    static CQueueWaitHistogram queueWaitHistogram;
+
+    static mapMsgCmdStats::iterator FindMsgStats(mapMsgCmdStats& mapStats, const std::string& strCommand);
+
     // outbound limit & stats
     static uint64_t nMaxOutboundTotalBytesSentInCycle;
     static uint64_t nMaxOutboundCycleStartTime;
@@ -432,6 +589,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -440,6 +598,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.randrange(vAddrToSend.size())] = addr;
@@ -450,23 +609,45 @@ public:
     }
 
 
+    static uint256 InventoryKey(const CInv& inv)
+    {
+        // called for every inv we relay, so stay off the heap
+        uint256 key = inv.hash;
+        unsigned char* p = key.begin();
+        for (int i = 0; i < 4; i++)
+            p[i] ^= (unsigned char)(inv.type >> (8 * i));
+        return key;
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(InventoryKey(inv));
         }
     }
 
+    bool HasInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(InventoryKey(inv));
+    }
+
     void PushInventory(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(InventoryKey(inv)))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -738,6 +919,14 @@ public:
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 
+    // Per-command stats, recorded for this peer and in the totals
+    void RecordMsgSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgRecv(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgProcessed(const std::string& strCommand, int64_t nProcessMicros, int64_t nQueueMicros);
+
+    static mapMsgCmdStats GetTotalMsgStats();
+    static void GetQueueWaitHistogram(std::vector<uint64_t>& vCounts, uint64_t& nTotalMicros);
+
     //!set the max outbound target in bytes
     static void SetMaxOutboundTarget(uint64_t targetSpacing, uint64_t limit);
     static uint64_t GetMaxOutboundTarget();
@@ -768,5 +957,8 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 
 #endif // BITCOIN_NET_H
@@ -6,8 +6,10 @@
 
 #include "obfuscation.h"
 #include "coincontrol.h"
+#include "crypto/sha256.h"
 #include "init.h"
 #include "main.h"
+#include "random.h"
 #include "masternodeman.h"
 #include "script/sign.h"
 #include "swifttx.h"
@@ -18,6 +20,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
@@ -2187,22 +2191,110 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
-bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+namespace {
+
+class CMessageSignerCacheHasher
+{
+public:
+    size_t operator()(const uint256& key) const {
+        return key.GetCheapHash();
+    }
+};
+
+/**
+ * Keys recovered from masternode message signatures. The same ping, vote or
+ * broadcast reaches us from many peers and budget votes are re-checked
+ * periodically, so each signature is only recovered once.
+ * Entries are SHA256(nonce || message hash || signature).
+ */
+class CMessageSignerCache
+{
+private:
+    uint256 nonce;
+    typedef boost::unordered_map<uint256, CKeyID, CMessageSignerCacheHasher> map_type;
+    map_type mapSigners;
+    boost::shared_mutex cs_signercache;
+
+public:
+    CMessageSignerCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig)
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry, CKeyID& keyID)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_signercache);
+        map_type::const_iterator it = mapSigners.find(entry);
+        if (it == mapSigners.end())
+            return false;
+        keyID = it->second;
+        return true;
+    }
+
+    void Set(const uint256& entry, const CKeyID& keyID)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_signercache);
+        while (mapSigners.size() >= MAX_MESSAGE_SIGNER_CACHE_ENTRIES) {
+            map_type::size_type s = GetRand(mapSigners.bucket_count());
+            map_type::local_iterator it = mapSigners.begin(s);
+            if (it != mapSigners.end(s)) {
+                mapSigners.erase(it->first);
+            }
+        }
+
+        mapSigners[entry] = keyID;
+    }
+};
+
+CMessageSignerCache messageSignerCache;
+
+}
+
+bool CObfuScationSigner::RecoverMessageSigner(const std::string& strMessage, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hash = ss.GetHash();
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    uint256 entry;
+    messageSignerCache.ComputeEntry(entry, hash, vchSig);
+    if (messageSignerCache.Get(entry, keyIDRet))
+        return true;
+
+    CPubKey pubkey;
+    if (!pubkey.RecoverCompact(hash, vchSig))
+        return false;
+
+    keyIDRet = pubkey.GetID();
+    messageSignerCache.Set(entry, keyIDRet);
+    return true;
+}
+
+bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    CKeyID keyID;
+    if (!RecoverMessageSigner(strMessage, vchSig, keyID)) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    return (keyID == pubkey.GetID());
+}
+
+bool CGossipSignatureCheck::operator()()
+{
+    CKeyID keyID;
+    obfuScationSigner.RecoverMessageSigner(strMessage, vchSig, keyID);
+    return true;
 }
 
 bool CObfuscationQueue::Sign()
@@ -2304,46 +2396,3 @@ void CObfuscationPool::RelayCompletedTransaction(const int sessionID, const bool
     for (CNode* pnode : vNodes)
         pnode->PushMessage("dsc", sessionID, error, errorID);
 }
-
-//TODO: Rename/move to core
-void ThreadCheckObfuScationPool()
-{
-    if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
-
-    // Make this thread recognisable as the wallet flushing thread
-    RenameThread("zcash-obfuscation");
-
-    unsigned int c = 0;
-
-    while (true) {
-        MilliSleep(1000);
-        //LogPrintf("ThreadCheckObfuScationPool::check timeout\n");
-
-        // try to sync from all available nodes, one step at a time
-        masternodeSync.Process();
-
-        if (masternodeSync.IsBlockchainSynced()) {
-            c++;
-
-            // check if we should activate or ping every few minutes,
-            // start right after sync is considered to be done
-            if (c % MASTERNODE_PING_SECONDS == 1) activeMasternode.ManageStatus();
-
-            if (c % 60 == 0) {
-                mnodeman.CheckAndRemove();
-                mnodeman.ProcessMasternodeConnections();
-                masternodePayments.CleanPaymentList();
-                CleanTransactionLocksList();
-            }
-
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
-
-            obfuScationPool.CheckTimeout();
-            obfuScationPool.CheckForCompleteQueue();
-
-            if (obfuScationPool.GetState() == POOL_STATUS_IDLE && c % 15 == 0) {
-                obfuScationPool.DoAutomaticDenominating();
-            }
-        }
-    }
-}
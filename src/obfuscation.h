@@ -49,6 +49,9 @@ class CActiveMasternode;
 static const CAmount OBFUSCATION_COLLATERAL = (10 * COIN);
 static const CAmount OBFUSCATION_POOL_MAX = (99999.99 * COIN);
 
+// keys recovered from masternode message signatures that we remember
+static const size_t MAX_MESSAGE_SIGNER_CACHE_ENTRIES = 100000;
+
 extern CObfuscationPool obfuScationPool;
 extern CObfuScationSigner obfuScationSigner;
 extern std::vector<CObfuscationQueue> vecObfuscationQueue;
@@ -257,6 +260,31 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Recover the key that signed the message, remembering it for later verifications
+    bool RecoverMessageSigner(const std::string& strMessage, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet);
+};
+
+/** Recovers the signer of one masternode gossip message ahead of its
+ *  handler, so that the handler's VerifyMessage finds it cached. Runs on the
+ *  gossip check queue; bad signatures are left for the handler to report.
+ */
+class CGossipSignatureCheck
+{
+private:
+    std::string strMessage;
+    std::vector<unsigned char> vchSig;
+
+public:
+    CGossipSignatureCheck() {}
+    CGossipSignatureCheck(const std::string& strMessageIn, const std::vector<unsigned char>& vchSigIn) : strMessage(strMessageIn), vchSig(vchSigIn) {}
+
+    bool operator()();
+
+    void swap(CGossipSignatureCheck& check)
+    {
+        strMessage.swap(check.strMessage);
+        vchSig.swap(check.vchSig);
+    }
 };
 
 /** Used to keep track of current status of Obfuscation pool
@@ -511,6 +539,4 @@ public:
     void RelayCompletedTransaction(const int sessionID, const bool error, const int errorID);
 };
 
-void ThreadCheckObfuScationPool();
-
 #endif
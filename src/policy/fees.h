@@ -6,9 +6,11 @@
 #define BITCOIN_POLICY_FEES_H
 
 #include "amount.h"
+#include "random.h"
 #include "uint256.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -282,4 +284,23 @@ private:
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
 };
+
+/**
+ * Rounds the fee filter we advertise to peers down to one of the fee
+ * estimator's exponentially spaced bucket boundaries, so the exact state of
+ * our mempool is not leaked through "feefilter".
+ */
+class FeeFilterRounder
+{
+public:
+    /** Create new FeeFilterRounder */
+    FeeFilterRounder(const CFeeRate& minIncrementalFee);
+
+    /** Quantize a minimum fee for privacy purpose before broadcast **/
+    CAmount round(CAmount currentMinFee);
+
+private:
+    std::set<double> feeset;
+    FastRandomContext insecure_rand;
+};
 #endif // BITCOIN_POLICY_FEES_H
@@ -30,9 +30,22 @@ static const char* ppszTypeName[] =
     "mn quorum",
     "mn announce",
     "mn ping",
-    "dstx"
+    "dstx",
+    "cmpct block"
 };
 
+static const char* allNetMessageTypes[] = {
+    "addr", "alert", "block", "blocktxn", "cmpctblock",
+    "dsa", "dsc", "dsee", "dseep", "dseg", "dsf", "dsi", "dsq", "dsr", "dss", "dssu", "dstx",
+    "fbs", "fbvote", "feefilter", "filteradd", "filterclear", "filterload",
+    "getaddr", "getblocks", "getblocktxn", "getdata", "getheaders", "getsporks",
+    "headers", "inv", "ix", "mempool", "merkleblock",
+    "mnb", "mnget", "mnp", "mnvs", "mnw", "mprop", "mvote",
+    "notfound", "ping", "pong", "reject", "sendcmpct", "sendheaders",
+    "spork", "ssc", "tx", "txlvote", "verack", "version"
+};
+static const std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
+
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
 {
     memcpy(pchMessageStart, pchMessageStartIn, MESSAGE_START_SIZE);
@@ -143,7 +156,7 @@ bool CInv::IsKnownType() const
 }
 
 bool CInv::IsMasterNodeType() const{
- 	return (type >= 6);
+ 	return (type >= MSG_SPORK && type <= MSG_DSTX);
 }
 
 const char* CInv::GetCommand() const
@@ -157,3 +170,8 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -176,7 +177,16 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // MSG_CMPCT_BLOCK is only requested in getdata, from peers that sent us
+    // "sendcmpct", and is answered with a "cmpctblock" (BIP 152).
+    MSG_CMPCT_BLOCK
 };
 
+/** Name under which messages with an unrecognised command are accounted */
+#define NET_MESSAGE_COMMAND_OTHER "*other*"
+
+/** All message commands this node sends or handles, in alphabetical order */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 #endif // BITCOIN_PROTOCOL_H
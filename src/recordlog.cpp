@@ -0,0 +1,179 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recordlog.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/** Records larger than this are taken for damage */
+static const unsigned int MAX_RECORD_SIZE = 0x02000000;
+
+static uint32_t RecordChecksum(const CDataStream& ssRecord)
+{
+    uint256 hash = Hash(ssRecord.begin(), ssRecord.end());
+    return ReadLE32(hash.begin());
+}
+
+CRecordLog::CRecordLog(const std::string& strFilenameIn, const std::string& strMagicMessageIn) :
+    strFilename(strFilenameIn), strMagicMessage(strMagicMessageIn), ssPending(SER_DISK, CLIENT_VERSION), nFileSize(0), fRewrite(true)
+{
+}
+
+boost::filesystem::path CRecordLog::GetPath() const
+{
+    return GetDataDir() / strFilename;
+}
+
+CRecordLog::ReadResult CRecordLog::Replay(std::function<void(unsigned char, CDataStream&)> fn)
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetPath();
+
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        error("%s : Failed to open file %s", __func__, path.string());
+        return FileError;
+    }
+
+    uint64_t nSize = boost::filesystem::file_size(path);
+    uint64_t nPos = 0;
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    try {
+        filein >> strMagicMessageTmp;
+        if (strMagicMessage != strMagicMessageTmp) {
+            error("%s : Invalid magic message in %s", __func__, strFilename);
+            return IncorrectMagicMessage;
+        }
+        filein >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+            error("%s : Invalid network magic number in %s", __func__, strFilename);
+            return IncorrectMagicNumber;
+        }
+    } catch (const std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectMagicMessage;
+    }
+    nPos = GetSerializeSize(strMagicMessage, SER_DISK, CLIENT_VERSION) + sizeof(pchMsgTmp);
+
+    unsigned int nRecords = 0;
+    std::vector<char> vchRecord;
+    while (nPos + 8 <= nSize) {
+        uint32_t nRecordSize, nChecksum;
+        try {
+            filein >> nRecordSize >> nChecksum;
+            if (nRecordSize == 0 || nRecordSize > MAX_RECORD_SIZE || nPos + 8 + nRecordSize > nSize)
+                break;
+            vchRecord.resize(nRecordSize);
+            filein.read(&vchRecord[0], nRecordSize);
+        } catch (const std::exception& e) {
+            break;
+        }
+
+        CDataStream ssRecord(vchRecord, SER_DISK, CLIENT_VERSION);
+        if (RecordChecksum(ssRecord) != nChecksum)
+            break;
+
+        try {
+            unsigned char nType;
+            ssRecord >> nType;
+            fn(nType, ssRecord);
+        } catch (const std::exception& e) {
+            error("%s : Deserialize error in %s - %s", __func__, strFilename, e.what());
+            break;
+        }
+        nPos += 8 + nRecordSize;
+        nRecords++;
+    }
+
+    if (nPos < nSize) {
+        LogPrintf("%s : Discarding %u damaged bytes at the end of %s\n", __func__, nSize - nPos, strFilename);
+        fflush(filein.Get());
+        if (!TruncateFile(filein.Get(), nPos)) {
+            // appending after the damage would hide the new records
+            error("%s : Failed to truncate %s", __func__, strFilename);
+            nFileSize = nPos;
+            return Ok;
+        }
+    }
+
+    nFileSize = nPos;
+    fRewrite = false;
+
+    LogPrint("masternode", "Replayed %u records from %s  %dms\n", nRecords, strFilename, GetTimeMillis() - nStart);
+    return Ok;
+}
+
+void CRecordLog::AppendRecord(const CDataStream& ssRecord)
+{
+    ssPending << (uint32_t)ssRecord.size() << RecordChecksum(ssRecord);
+    ssPending.write(&ssRecord[0], ssRecord.size());
+}
+
+void CRecordLog::Reset()
+{
+    ssPending.clear();
+    fRewrite = true;
+}
+
+bool CRecordLog::NeedsRewrite(uint64_t nLiveSize) const
+{
+    if (fRewrite) return true;
+
+    uint64_t nSize = GetFileSize();
+    return nSize > RECORD_LOG_MIN_COMPACT_SIZE && nSize > 2 * nLiveSize;
+}
+
+bool CRecordLog::Flush()
+{
+    if (!fRewrite && ssPending.empty())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetPath();
+    boost::filesystem::path pathWrite = fRewrite ? path.string() + ".new" : path;
+
+    CDataStream ssWrite(SER_DISK, CLIENT_VERSION);
+    if (fRewrite) {
+        ssWrite << strMagicMessage;
+        ssWrite << FLATDATA(Params().MessageStart());
+    }
+    if (!ssPending.empty())
+        ssWrite.write(&ssPending[0], ssPending.size());
+
+    // After a failure the file may end in part of the records, or miss some
+    // of them, so the owner has to write everything over on its next flush
+    FILE* file = fopen(pathWrite.string().c_str(), fRewrite ? "wb" : "ab");
+    if (file == NULL) {
+        Reset();
+        return error("%s : Failed to open file %s", __func__, pathWrite.string());
+    }
+    if (fwrite(&ssWrite[0], 1, ssWrite.size(), file) != ssWrite.size()) {
+        fclose(file);
+        Reset();
+        return error("%s : Failed to write to %s", __func__, pathWrite.string());
+    }
+    FileCommit(file);
+    fclose(file);
+
+    if (fRewrite) {
+        if (!RenameOver(pathWrite, path)) {
+            Reset();
+            return error("%s : Failed to rename %s", __func__, pathWrite.string());
+        }
+        nFileSize = 0;
+        fRewrite = false;
+    }
+    nFileSize += ssWrite.size();
+    ssPending.clear();
+
+    LogPrint("masternode", "Written %u bytes to %s  %dms\n", ssWrite.size(), strFilename, GetTimeMillis() - nStart);
+    return true;
+}
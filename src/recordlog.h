@@ -0,0 +1,182 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECORDLOG_H
+#define BITCOIN_RECORDLOG_H
+
+#include "clientversion.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <type_traits>
+
+#include <boost/filesystem/path.hpp>
+
+/** Don't compact a record log smaller than this */
+static const uint64_t RECORD_LOG_MIN_COMPACT_SIZE = 1024 * 1024;
+
+/**
+ * Append-only file of checksummed records, for the masternode, payment and
+ * budget caches. The file holds a header (a file specific magic message and
+ * the network magic) followed by records of a size, a checksum and a type
+ * byte plus payload. Records are queued with Append and written by Flush, so
+ * a crash only loses what was queued since the last flush; a record that was
+ * half written is cut off by the next Replay.
+ *
+ * Not thread safe; the owning cache db serializes access.
+ */
+class CRecordLog
+{
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber
+    };
+
+    CRecordLog(const std::string& strFilenameIn, const std::string& strMagicMessageIn);
+
+    /** Pass every intact record to fn, in file order, and cut off a damaged tail */
+    ReadResult Replay(std::function<void(unsigned char, CDataStream&)> fn);
+
+    template <typename T>
+    void Append(unsigned char nType, const T& obj)
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << nType << obj;
+        AppendRecord(ssRecord);
+    }
+
+    /** Drop the file and the queued records; the next Flush starts the file over */
+    void Reset();
+    /** Write the queued records. On failure the log is Reset, so the owner appends all its records again */
+    bool Flush();
+
+    uint64_t GetFileSize() const { return nFileSize + ssPending.size(); }
+    /**
+     * Whether the owner should Reset and append all its records: the file is
+     * to be started over anyway, or it is mostly superseded records next to
+     * the nLiveSize bytes that are current.
+     */
+    bool NeedsRewrite(uint64_t nLiveSize) const;
+
+private:
+    std::string strFilename;
+    std::string strMagicMessage;
+    // queued record bytes, framing included
+    CDataStream ssPending;
+    // bytes of intact records in the file, header included
+    uint64_t nFileSize;
+    // the file on disk is missing, foreign or dropped
+    bool fRewrite;
+
+    boost::filesystem::path GetPath() const;
+    void AppendRecord(const CDataStream& ssRecord);
+};
+
+/**
+ * Tracks which entries of a map keyed by object hash are in a CRecordLog, so
+ * only entries added or removed since the last flush are written. Entries
+ * must not change once added; an owner whose objects have fields that do
+ * change keys them by a hash of the rest, and logs or recomputes those fields
+ * itself. The map values may be pointers to the entries.
+ */
+class CRecordLogIndex
+{
+public:
+    CRecordLogIndex() : nLiveSize(0) {}
+
+    /** Queue a put record for new entries of mapIn and an erase record for entries gone from it */
+    template <typename V>
+    void AppendChanges(CRecordLog& log, unsigned char nTypePut, unsigned char nTypeErase, const std::map<uint256, V>& mapIn)
+    {
+        AppendChangesAs<typename std::remove_cv<typename std::remove_pointer<V>::type>::type>(log, nTypePut, nTypeErase, mapIn);
+    }
+
+    /** AppendChanges, with each put record holding the entry converted to R */
+    template <typename R, typename V>
+    void AppendChangesAs(CRecordLog& log, unsigned char nTypePut, unsigned char nTypeErase, const std::map<uint256, V>& mapIn)
+    {
+        std::map<uint256, unsigned int>::iterator itLogged = mapLogged.begin();
+        typename std::map<uint256, V>::const_iterator it = mapIn.begin();
+        while (itLogged != mapLogged.end() || it != mapIn.end()) {
+            if (it == mapIn.end() || (itLogged != mapLogged.end() && itLogged->first < it->first)) {
+                log.Append(nTypeErase, itLogged->first);
+                nLiveSize -= itLogged->second;
+                mapLogged.erase(itLogged++);
+            } else if (itLogged == mapLogged.end() || it->first < itLogged->first) {
+                R record(Entry(it->second));
+                unsigned int nSize = GetSerializeSize(record, SER_DISK, CLIENT_VERSION);
+                log.Append(nTypePut, std::make_pair(it->first, record));
+                nLiveSize += nSize;
+                mapLogged.insert(itLogged, std::make_pair(it->first, nSize));
+                ++it;
+            } else {
+                ++itLogged;
+                ++it;
+            }
+        }
+    }
+
+    /** Queue a put record for every entry of mapIn, for a log that was Reset */
+    template <typename V>
+    void AppendAll(CRecordLog& log, unsigned char nTypePut, const std::map<uint256, V>& mapIn)
+    {
+        Clear();
+        AppendChanges(log, nTypePut, nTypePut, mapIn);
+    }
+
+    template <typename R, typename V>
+    void AppendAllAs(CRecordLog& log, unsigned char nTypePut, const std::map<uint256, V>& mapIn)
+    {
+        Clear();
+        AppendChangesAs<R>(log, nTypePut, nTypePut, mapIn);
+    }
+
+    /** Note an entry found while replaying */
+    template <typename V>
+    void Logged(const uint256& hash, const V& obj)
+    {
+        unsigned int nSize = GetSerializeSize(obj, SER_DISK, CLIENT_VERSION);
+        std::pair<std::map<uint256, unsigned int>::iterator, bool> ret = mapLogged.insert(std::make_pair(hash, nSize));
+        if (!ret.second) {
+            nLiveSize -= ret.first->second;
+            ret.first->second = nSize;
+        }
+        nLiveSize += nSize;
+    }
+
+    void Erased(const uint256& hash)
+    {
+        std::map<uint256, unsigned int>::iterator it = mapLogged.find(hash);
+        if (it == mapLogged.end()) return;
+        nLiveSize -= it->second;
+        mapLogged.erase(it);
+    }
+
+    void Clear()
+    {
+        mapLogged.clear();
+        nLiveSize = 0;
+    }
+
+    /** Approximate bytes the logged entries would take in a compacted log */
+    uint64_t GetLiveSize() const { return nLiveSize; }
+
+private:
+    template <typename V>
+    static const V& Entry(const V& obj) { return obj; }
+    template <typename V>
+    static const V& Entry(const V* pobj) { return *pobj; }
+
+    // logged entries and their serialized size
+    std::map<uint256, unsigned int> mapLogged;
+    uint64_t nLiveSize;
+};
+
+#endif // BITCOIN_RECORDLOG_H
@@ -9,6 +9,7 @@
 #include "init.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternode-jobs.h"
 #include "masternode-payments.h"
 #include "masternodeconfig.h"
 #include "masternodeman.h"
@@ -378,6 +379,49 @@ UniValue masternodedebug (const UniValue& params, bool fHelp)
         return activeMasternode.GetStatus();
 }
 
+UniValue getmasternodejobs (const UniValue& params, bool fHelp)
+{
+    if (fHelp || (params.size() != 0))
+        throw runtime_error(
+            "getmasternodejobs\n"
+            "\nGet the masternode and obfuscation maintenance jobs and their runtime stats\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"name\",     (string) Job name\n"
+            "    \"interval\": n,      (numeric) Seconds between periodic runs\n"
+            "    \"runs\": n,          (numeric) Number of runs\n"
+            "    \"triggered\": n,     (numeric) Runs triggered by events\n"
+            "    \"total_ms\": x.xxx,  (numeric) Time spent in the job\n"
+            "    \"avg_ms\": x.xxx,    (numeric) Average time of a run\n"
+            "    \"max_ms\": x.xxx,    (numeric) Longest run\n"
+            "    \"last_ms\": x.xxx,   (numeric) Time of the last run\n"
+            "    \"lastrun\": ttt      (numeric) Time of the last run in seconds since epoch (Jan 1 1970 GMT)\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmasternodejobs", "") + HelpExampleRpc("getmasternodejobs", ""));
+
+    UniValue ret(UniValue::VARR);
+    for (const CMasternodeJob& job : masternodeJobs.GetJobs()) {
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("name", job.strName);
+        obj.pushKV("interval", job.nInterval);
+        obj.pushKV("runs", job.nRuns);
+        obj.pushKV("triggered", job.nTriggeredRuns);
+        obj.pushKV("total_ms", job.nTimeTotal * 0.001);
+        obj.pushKV("avg_ms", job.nRuns ? job.nTimeTotal * 0.001 / job.nRuns : 0.0);
+        obj.pushKV("max_ms", job.nTimeMax * 0.001);
+        obj.pushKV("last_ms", job.nTimeLast * 0.001);
+        obj.pushKV("lastrun", job.nLastRun);
+        ret.push_back(obj);
+    }
+
+    return ret;
+}
+
 UniValue startmasternode (const UniValue& params, bool fHelp)
 {
     std::string strCommand;
@@ -1171,6 +1215,7 @@ static const CRPCCommand commands[] =
     { "masternode",         "masternodeconnect",    &masternodeconnect,   true  },
     { "masternode",         "masternodecurrent",    &masternodecurrent,   true  },
     { "masternode",         "masternodedebug",      &masternodedebug,     true  },
+    { "masternode",         "getmasternodejobs",    &getmasternodejobs,   true  },
     { "masternode",         "startmasternode",      &startmasternode,     true  },
     { "masternode",         "createmasternodekey",  &createmasternodekey, true  },
     { "masternode",         "getmasternodeoutputs", &getmasternodeoutputs,true  },
@@ -563,10 +563,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "BZEdge is downloading blocks...");
 
 
+    // Reserved only for a template built here; a cached one comes with its own.
     MinerAddress minerAddress;
-    GetMainSignals().AddressForMining(minerAddress);
+    bool fMinerAddress = false;
 
-    static unsigned int nTransactionsUpdatedLast;
     static std::optional<CMutableTransaction> cached_next_cb_mtx;
     static int cached_next_cb_height;
 
@@ -580,26 +580,36 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
 
     if (!lpval.isNull())
     {
-        // Wait to respond until either the best block changes, OR some time passes and there are more transactions
+        // Wait to respond until either the best block changes, OR the fees of the
+        // background template rise enough to be worth switching to, OR some
+        // time passes and there are more transactions
         uint256 hashWatchedChain;
         boost::system_time checktxtime;
-        unsigned int nTransactionsUpdatedLastLP;
+        unsigned int nLongPollIdLP;
+        unsigned int nTransactionsUpdatedLP;
+        // keeps the background template up to date with the mempool while we wait
+        CBlockTemplateWaiter waiter;
 
         if (lpval.isStr())
         {
-            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            // Format: <hashBestChain><nBlockTemplateLongPollId>
             std::string lpstr = lpval.get_str();
 
             hashWatchedChain.SetHex(lpstr.substr(0, 64));
-            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+            nLongPollIdLP = atoi64(lpstr.substr(64));
         }
         else
         {
             // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
             hashWatchedChain = chainActive.Tip()->GetBlockHash();
-            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+            nLongPollIdLP = GetBlockTemplateLongPollId();
         }
 
+        // Compare against the mempool the caller's template was built from,
+        // not the one at arrival, so transactions that came in between count.
+        if (!GetCachedBlockTemplateTxUpdated(hashWatchedChain, nTransactionsUpdatedLP))
+            nTransactionsUpdatedLP = mempool.GetTransactionsUpdated();
+
         {
             checktxtime = boost::get_system_time() + boost::posix_time::seconds(10);
 
@@ -615,6 +625,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
                 // Note that the time to create the coinbase tx here does not add to,
                 // but instead is included in, the 10 second delay, since we're waiting
                 // until an absolute time is reached.
+                if (!cached_next_cb_mtx && !fMinerAddress) {
+                    GetMainSignals().AddressForMining(minerAddress);
+                    fMinerAddress = true;
+                }
                 if (!cached_next_cb_mtx && IsShieldedMinerAddress(minerAddress)) {
                     cached_next_cb_height = nHeight + 2;
                     cached_next_cb_mtx = CreateCoinbaseTransaction(
@@ -628,8 +642,11 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
                 // while waiting for cs_main; if so, don't discard next_cb_mtx.
                 if (chainActive.Tip()->GetBlockHash() != hashWatchedChain) break;
 
-                // Timeout: Check transactions for update
-                if (timedout && mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP) {
+                // The background template builder signals cvBlockChange when
+                // the template's fees have risen meaningfully; otherwise,
+                // on timeout, check transactions for update.
+                if (GetBlockTemplateLongPollId() != nLongPollIdLP ||
+                    (timedout && mempool.GetTransactionsUpdated() != nTransactionsUpdatedLP)) {
                     // Create a non-empty block.
                     next_cb_mtx = nullopt;
                     break;
@@ -647,56 +664,48 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (!lpval.isNull() || pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    // Serve the background template when it is built on the current tip;
+    // otherwise build one here and hand it to the background builder.
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    std::shared_ptr<const CBlockTemplate> pblocktemplate;
+    unsigned int nLongPollId = GetBlockTemplateLongPollId();
+    if (next_cb_mtx || !GetCachedBlockTemplate(pindexPrev, pblocktemplate, minerAddress))
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = nullptr;
-
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-
-        // If we're going to use the precomputed coinbase (empty block) and there are
-        // transactions waiting in the mempool, make sure that on the next call to this
-        // RPC, we consider the transaction count to have changed so we return a new
-        // template (that includes these transactions) so they don't get stuck.
-        if (next_cb_mtx && mempool.size() > 0) nTransactionsUpdatedLast = 0;
-
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = nullptr;
-        }
+        if (!fMinerAddress)
+            GetMainSignals().AddressForMining(minerAddress);
 
         // Throw an error if no address valid for mining was provided.
         if (!std::visit(IsValidMinerAddress(), minerAddress)) {
             throw JSONRPCError(RPC_INTERNAL_ERROR, "No miner address available (mining requires a wallet or -mineraddress)");
         }
 
-        pblocktemplate = CreateNewBlock(Params(), minerAddress, next_cb_mtx);
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        pblocktemplate.reset(CreateNewBlock(Params(), minerAddress, next_cb_mtx));
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Mark script as important because it was used at least for one coinbase output
-        std::visit(KeepMinerAddress(), minerAddress);
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (next_cb_mtx) {
+            // The precomputed coinbase makes this an empty block. If there are
+            // transactions waiting in the mempool, hand out a longpoll id that
+            // is already stale, so the next longpoll returns a template that
+            // includes them and they don't get stuck.
+            if (mempool.size() > 0) nLongPollId = 0;
+        } else {
+            SetCachedBlockTemplate(pblocktemplate, minerAddress, nTransactionsUpdated);
+            nLongPollId = GetBlockTemplateLongPollId();
+        }
     }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Mark script as important because it was used at least for one coinbase output
+    std::visit(KeepMinerAddress(), minerAddress);
+
+    const CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     const Consensus::Params& consensus = Params().GetConsensus();
 
-    // Update nTime
-    UpdateTime(pblock, consensus, pindexPrev);
-    pblock->nNonce = uint256();
+    // Update nTime on a copy of the header, as the template may be shared
+    CBlockHeader header = pblock->GetBlockHeader();
+    UpdateTime(&header, consensus, pindexPrev);
 
     UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
 
@@ -740,7 +749,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue aux(UniValue::VOBJ);
     aux.pushKV("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end()));
 
-    arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+    arith_uint256 hashTarget = arith_uint256().SetCompact(header.nBits);
 
     static UniValue aMutable(UniValue::VARR);
     if (aMutable.empty())
@@ -766,15 +775,15 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         result.pushKV("coinbaseaux", aux);
         result.pushKV("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue);
     }
-    result.pushKV("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast));
+    result.pushKV("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nLongPollId));
     result.pushKV("target", hashTarget.GetHex());
     result.pushKV("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1);
     result.pushKV("mutable", aMutable);
     result.pushKV("noncerange", "00000000ffffffff");
     result.pushKV("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS);
     result.pushKV("sizelimit", (int64_t)MAX_BLOCK_SIZE);
-    result.pushKV("curtime", pblock->GetBlockTime());
-    result.pushKV("bits", strprintf("%08x", pblock->nBits));
+    result.pushKV("curtime", header.GetBlockTime());
+    result.pushKV("bits", strprintf("%08x", header.nBits));
     result.pushKV("height", (int64_t)(pindexPrev->nHeight+1));
     result.pushKV("votes", aVotes);
 
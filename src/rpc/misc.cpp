@@ -417,6 +417,7 @@ UniValue mnsync(const UniValue& params, bool fHelp)
     if (strMode == "status") {
         UniValue obj(UniValue::VOBJ);
 
+        LOCK(masternodeSync.cs);
         obj.pushKV("IsBlockchainSynced", masternodeSync.IsBlockchainSynced());
         obj.pushKV("lastMasternodeList", masternodeSync.lastMasternodeList);
         obj.pushKV("lastMasternodeWinner", masternodeSync.lastMasternodeWinner);
@@ -431,7 +432,7 @@ UniValue mnsync(const UniValue& params, bool fHelp)
         obj.pushKV("countMasternodeWinner", masternodeSync.countMasternodeWinner);
         obj.pushKV("countBudgetItemProp", masternodeSync.countBudgetItemProp);
         obj.pushKV("countBudgetItemFin", masternodeSync.countBudgetItemFin);
-        obj.pushKV("RequestedMasternodeAssets", masternodeSync.RequestedMasternodeAssets);
+        obj.pushKV("RequestedMasternodeAssets", masternodeSync.GetSyncValue());
         obj.pushKV("RequestedMasternodeAttempt", masternodeSync.RequestedMasternodeAttempt);
 
         return obj;
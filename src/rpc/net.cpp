@@ -61,6 +61,25 @@ UniValue ping(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static UniValue MsgCmdStatsToJSON(const mapMsgCmdStats& mapStats)
+{
+    UniValue obj(UniValue::VOBJ);
+    for (const std::pair<std::string, CMsgCmdStats>& item : mapStats) {
+        const CMsgCmdStats& stats = item.second;
+        if (stats.nSendCount == 0 && stats.nRecvCount == 0)
+            continue;
+        UniValue cmd(UniValue::VOBJ);
+        cmd.pushKV("bytessent", stats.nSendBytes);
+        cmd.pushKV("msgssent", stats.nSendCount);
+        cmd.pushKV("bytesrecv", stats.nRecvBytes);
+        cmd.pushKV("msgsrecv", stats.nRecvCount);
+        cmd.pushKV("processmicros", stats.nProcessMicros);
+        cmd.pushKV("queuemicros", stats.nQueueMicros);
+        obj.pushKV(item.first, cmd);
+    }
+    return obj;
+}
+
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
@@ -105,7 +124,18 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"msgstats\": {            (json object) Traffic per message command, for commands seen on this connection\n"
+            "      \"command\": {\n"
+            "        \"bytessent\": n,      (numeric) Bytes sent in messages of this command, headers included\n"
+            "        \"msgssent\": n,       (numeric) Messages of this command sent\n"
+            "        \"bytesrecv\": n,      (numeric) Bytes received in messages of this command, headers included\n"
+            "        \"msgsrecv\": n,       (numeric) Messages of this command received\n"
+            "        \"processmicros\": n,  (numeric) Microseconds spent handling received messages of this command\n"
+            "        \"queuemicros\": n     (numeric) Microseconds received messages of this command waited to be handled\n"
+            "      },\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -157,6 +187,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.pushKV("inflight", heights);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
+        obj.pushKV("msgstats", MsgCmdStatsToJSON(stats.mapMsgStats));
 
         ret.push_back(obj);
     }
@@ -401,6 +432,64 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns network traffic and message handling time per message command, summed over\n"
+            "all peers since startup, and how long received messages waited to be handled.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"commands\": {            (json object) Totals per message command, for commands seen so far\n"
+            "    \"command\": {\n"
+            "      \"bytessent\": n,      (numeric) Bytes sent in messages of this command, headers included\n"
+            "      \"msgssent\": n,       (numeric) Messages of this command sent\n"
+            "      \"bytesrecv\": n,      (numeric) Bytes received in messages of this command, headers included\n"
+            "      \"msgsrecv\": n,       (numeric) Messages of this command received\n"
+            "      \"processmicros\": n,  (numeric) Microseconds spent handling received messages of this command\n"
+            "      \"queuemicros\": n     (numeric) Microseconds received messages of this command waited to be handled\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"queuewait\": {\n"
+            "    \"totalmicros\": n,      (numeric) Total time received messages waited to be handled\n"
+            "    \"buckets\": [\n"
+            "      {\n"
+            "        \"below_ms\": n,       (numeric) Upper bound of this bucket in milliseconds, absent for the last bucket\n"
+            "        \"count\": n           (numeric) Messages that waited at least as long as the previous bucket's bound, but less than this one\n"
+            "      },\n"
+            "      ...\n"
+            "    ]\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetmsgstats", "")
+            + HelpExampleRpc("getnetmsgstats", "")
+       );
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("commands", MsgCmdStatsToJSON(CNode::GetTotalMsgStats()));
+
+    std::vector<uint64_t> vCounts;
+    uint64_t nTotalMicros;
+    CNode::GetQueueWaitHistogram(vCounts, nTotalMicros);
+    UniValue buckets(UniValue::VARR);
+    for (unsigned int i = 0; i < vCounts.size(); i++) {
+        UniValue bucket(UniValue::VOBJ);
+        int64_t nLimit = CQueueWaitHistogram::BucketLimitMillis(i);
+        if (nLimit >= 0)
+            bucket.pushKV("below_ms", nLimit);
+        bucket.pushKV("count", vCounts[i]);
+        buckets.push_back(bucket);
+    }
+    UniValue queueWait(UniValue::VOBJ);
+    queueWait.pushKV("totalmicros", nTotalMicros);
+    queueWait.pushKV("buckets", buckets);
+    obj.pushKV("queuewait", queueWait);
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -634,6 +723,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true  },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
+    { "network",            "getnetmsgstats",         &getnetmsgstats,         true  },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
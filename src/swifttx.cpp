@@ -20,12 +20,7 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
-std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+CTxLockManager txLockManager;
 int nCompleteTXLocks;
 
 //txlock - Locks transaction
@@ -50,7 +45,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
+        if (txLockManager.HaveTxLockRequest(tx.GetHash())) {
             return;
         }
 
@@ -82,7 +77,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddTxLockRequest(tx);
 
             LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -91,32 +86,23 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
-
             // can we get the conflicting transaction as proof?
 
             LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : rejected %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
+            txLockManager.AddRejectedTxLockRequest(tx);
 
             // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()) {
-                //we only care if we have a complete tx lock
-                if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-                    if (!CheckForConflictingLocks(tx)) {
-                        LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
-                    }
+            //we only care if we have a complete tx lock
+            if (txLockManager.GetSignatures(tx.GetHash()) >= SWIFTTX_SIGNATURES_REQUIRED) {
+                if (!txLockManager.CheckForConflictingLocks(tx)) {
+                    LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
+
+                    //reprocess the last 15 blocks
+                    ReprocessBlocks(15);
+                    txLockManager.AddTxLockRequest(tx);
                 }
             }
 
@@ -130,33 +116,16 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockVote.count(ctx.GetHash())) {
+        if (!txLockManager.AddTxLockVote(ctx)) {
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
-
         if (ProcessConsensusVote(pfrom, ctx)) {
-            //Spam/Dos protection
-            /*
-                Masternodes will sometimes propagate votes before the transaction is known to the client.
-                This tracks those messages and allows it at the same rate of the rest of the network, if
-                a peer violates it, it will simply be ignored
-            */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
-
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+            if (txLockManager.IsUnknownVoteSpam(ctx)) {
+                LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
+                    ctx.vinMasternode.ToString().c_str(),
+                    ctx.txHash.ToString().c_str());
+                return;
             }
             RelayInv(inv);
         }
@@ -231,20 +200,7 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
-    if (!mapTxLocks.count(tx.GetHash())) {
-        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
-    } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
-        LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
-    }
-
+    txLockManager.SetLockHeight(tx.GetHash(), nBlockHeight);
 
     return nBlockHeight;
 }
@@ -284,7 +240,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    txLockManager.AddTxLockVote(ctx);
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
     RelayInv(inv);
@@ -318,142 +274,293 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         return false;
     }
 
-    if (!mapTxLocks.count(ctx.txHash)) {
-        LogPrintf("SwiftX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
-
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+    int nSignatures = txLockManager.AddSignature(ctx);
 
 #ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if (pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
+    if (pwalletMain) {
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        if (pwalletMain->mapRequestCount.count(ctx.txHash))
+            pwalletMain->mapRequestCount[ctx.txHash]++;
+    }
 #endif
 
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+    LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", nSignatures, ctx.GetHash().ToString().c_str());
 
-        if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-            LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+    if (nSignatures >= SWIFTTX_SIGNATURES_REQUIRED) {
+        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", ctx.txHash.ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if (!CheckForConflictingLocks(tx)) {
+        bool fRejected = false;
+        if (txLockManager.CompleteLock(ctx.txHash, fRejected)) {
 #ifdef ENABLE_WALLET
-                if (pwalletMain) {
+            if (pwalletMain) {
+                {
+                    // LOCK(pwalletMain->cs_wallet);
+                    map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(ctx.txHash);
+                    if (mi != pwalletMain->mapWallet.end())
                     {
-                        // LOCK(pwalletMain->cs_wallet);
-                        map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find((*i).second.txHash);
-                        if (mi != pwalletMain->mapWallet.end())
-                        {
-                            pwalletMain->UpdatedTransaction((*i).second.txHash);
-                            nCompleteTXLocks++;
-                        }
+                        pwalletMain->UpdatedTransaction(ctx.txHash);
+                        nCompleteTXLocks++;
                     }
                 }
+            }
 #endif
 
-                if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
-
-                // resolve conflicts
+            // resolve conflicts
 
-                //if this tx lock was rejected, we need to remove the conflicting blocks
-                if (mapTxLockReqRejected.count((*i).second.txHash)) {
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
-                }
+            //if this tx lock was rejected, we need to remove the conflicting blocks
+            if (fRejected) {
+                //reprocess the last 15 blocks
+                ReprocessBlocks(15);
             }
         }
-        return true;
     }
+    return true;
+}
 
+bool CTxLockManager::HaveTxLockRequest(const uint256& txHash) const
+{
+    LOCK(cs);
+    return mapTxLockReq.count(txHash) || mapTxLockReqRejected.count(txHash);
+}
 
-    return false;
+bool CTxLockManager::GetTxLockRequest(const uint256& txHash, CTransaction& txRet) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransaction>::const_iterator it = mapTxLockReq.find(txHash);
+    if (it == mapTxLockReq.end())
+        return false;
+    txRet = it->second;
+    return true;
 }
 
-bool CheckForConflictingLocks(CTransaction& tx)
+void CTxLockManager::AddTxLockRequest(const CTransaction& tx)
 {
-    /*
-        It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
-        In that case, they will cancel each other out.
+    LOCK(cs);
+    mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+}
 
-        Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
-        rescan the blocks and find they're acceptable and then take the chain with the most work.
+void CTxLockManager::AddRejectedTxLockRequest(const CTransaction& tx)
+{
+    LOCK(cs);
+    mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+    LockInputs(tx);
+}
+
+bool CTxLockManager::HaveTxLockVote(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapTxLockVote.count(hash);
+}
+
+bool CTxLockManager::GetTxLockVote(const uint256& hash, CConsensusVote& voteRet) const
+{
+    LOCK(cs);
+    std::map<uint256, CConsensusVote>::const_iterator it = mapTxLockVote.find(hash);
+    if (it == mapTxLockVote.end())
+        return false;
+    voteRet = it->second;
+    return true;
+}
+
+bool CTxLockManager::AddTxLockVote(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    return mapTxLockVote.insert(make_pair(vote.GetHash(), vote)).second;
+}
+
+bool CTxLockManager::IsUnknownVoteSpam(const CConsensusVote& vote)
+{
+    //Spam/Dos protection
+    /*
+        Masternodes will sometimes propagate votes before the transaction is known to the client.
+        This tracks those messages and allows it at the same rate of the rest of the network, if
+        a peer violates it, it will simply be ignored
     */
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
-        }
-    }
+    LOCK(cs);
+    if (mapTxLockReq.count(vote.txHash) || mapTxLockReqRejected.count(vote.txHash))
+        return false;
+
+    const uint256& hash = vote.vinMasternode.prevout.hash;
+    int64_t nNow = GetTime();
+    if (!mapUnknownVotes.count(hash))
+        SetUnknownVoteTime(hash, nNow + (60 * 10));
 
+    if (mapUnknownVotes[hash] > nNow && mapUnknownVotes[hash] - GetAverageVoteTime() > 60 * 10)
+        return true;
+
+    SetUnknownVoteTime(hash, nNow + (60 * 10));
     return false;
 }
 
-int64_t GetAverageVoteTime()
+// requires LOCK(cs)
+void CTxLockManager::SetUnknownVoteTime(const uint256& hash, int64_t nTime)
+{
+    std::pair<std::map<uint256, int64_t>::iterator, bool> ret = mapUnknownVotes.insert(make_pair(hash, nTime));
+    if (!ret.second) {
+        nUnknownVoteTimeTotal -= ret.first->second;
+        ret.first->second = nTime;
+    }
+    nUnknownVoteTimeTotal += nTime;
+}
+
+// requires LOCK(cs)
+int64_t CTxLockManager::GetAverageVoteTime() const
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
+    if (mapUnknownVotes.empty()) return 0;
+    return nUnknownVoteTimeTotal / (int64_t)mapUnknownVotes.size();
+}
 
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
+// requires LOCK(cs)
+CTransactionLock& CTxLockManager::GetOrCreateLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it != mapTxLocks.end()) {
+        LogPrint("swiftx", "SwiftX - Transaction Lock Exists %s !\n", txHash.ToString().c_str());
+        return it->second;
     }
 
-    return total / count;
+    LogPrintf("SwiftX - New Transaction Lock %s !\n", txHash.ToString().c_str());
+
+    CTransactionLock& newLock = mapTxLocks[txHash];
+    newLock.nBlockHeight = 0;
+    newLock.nTimeout = GetTime() + (60 * 5);
+    newLock.txHash = txHash;
+    newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
+    setLockExpirations.insert(make_pair((int64_t)newLock.nExpiration, txHash));
+    return newLock;
 }
 
-void CleanTransactionLocksList()
+// requires LOCK(cs)
+void CTxLockManager::SetExpiration(CTransactionLock& lock, int64_t nExpiration)
 {
-    if (chainActive.Tip() == NULL) return;
+    setLockExpirations.erase(make_pair((int64_t)lock.nExpiration, lock.txHash));
+    lock.nExpiration = nExpiration;
+    setLockExpirations.insert(make_pair((int64_t)lock.nExpiration, lock.txHash));
+}
+
+// requires LOCK(cs)
+void CTxLockManager::LockInputs(const CTransaction& tx)
+{
+    BOOST_FOREACH (const CTxIn& in, tx.vin)
+        mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+}
+
+void CTxLockManager::SetLockHeight(const uint256& txHash, int nBlockHeight)
+{
+    LOCK(cs);
+    GetOrCreateLock(txHash).nBlockHeight = nBlockHeight;
+}
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+int CTxLockManager::AddSignature(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    CTransactionLock& lock = GetOrCreateLock(vote.txHash);
+    lock.AddSignature(vote);
+    return lock.CountSignatures();
+}
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+int CTxLockManager::GetSignatures(const uint256& txHash) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end())
+        return -1;
+    return it->second.CountSignatures();
+}
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+bool CTxLockManager::IsTimedOut(const uint256& txHash) const
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end())
+        return false;
+    return GetTime() > it->second.nTimeout;
+}
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+bool CTxLockManager::CompleteLock(const uint256& txHash, bool& fRejectedRet)
+{
+    LOCK(cs);
+    fRejectedRet = false;
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+    std::map<uint256, CTransaction>::const_iterator it = mapTxLockReq.find(txHash);
+    if (it != mapTxLockReq.end()) {
+        if (CheckForConflictingLocks(it->second))
+            return false;
+        LockInputs(it->second);
+    }
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
+    fRejectedRet = mapTxLockReqRejected.count(txHash);
+    return true;
+}
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+bool CTxLockManager::CheckForConflictingLocks(const CTransaction& tx)
+{
+    /*
+        It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
+        In that case, they will cancel each other out.
+
+        Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
+        rescan the blocks and find they're acceptable and then take the chain with the most work.
+    */
+    LOCK(cs);
+    uint256 hashLock;
+    if (!HasConflictingLock(tx, hashLock))
+        return false;
+
+    LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), hashLock.ToString().c_str());
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(tx.GetHash());
+    if (it != mapTxLocks.end()) SetExpiration(it->second, GetTime());
+    it = mapTxLocks.find(hashLock);
+    if (it != mapTxLocks.end()) SetExpiration(it->second, GetTime());
+    return true;
+}
+
+bool CTxLockManager::HasConflictingLock(const CTransaction& tx, uint256& hashLockRet) const
+{
+    LOCK(cs);
+    if (mapLockedInputs.empty())
+        return false;
+
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            hashLockRet = it->second;
+            return true;
         }
     }
+
+    return false;
+}
+
+void CTxLockManager::CheckAndRemove()
+{
+    if (chainActive.Tip() == NULL) return;
+
+    LOCK(cs);
+    int64_t nNow = GetTime();
+    std::set<std::pair<int64_t, uint256> >::iterator it = setLockExpirations.begin();
+    while (it != setLockExpirations.end() && nNow > it->first) { //keep them for an hour
+        std::map<uint256, CTransactionLock>::iterator itLock = mapTxLocks.find(it->second);
+        assert(itLock != mapTxLocks.end());
+        const CTransactionLock& lock = itLock->second;
+        LogPrintf("Removing old transaction lock %s\n", lock.txHash.ToString().c_str());
+
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(lock.txHash);
+        if (itReq != mapTxLockReq.end()) {
+            BOOST_FOREACH (const CTxIn& in, itReq->second.vin)
+                mapLockedInputs.erase(in.prevout);
+
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(lock.txHash);
+
+            BOOST_FOREACH (const CConsensusVote& v, lock.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
+        }
+
+        mapTxLocks.erase(itLock);
+        setLockExpirations.erase(it++);
+    }
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -463,10 +570,15 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
+std::string CConsensusVote::GetSignatureMessage()
+{
+    return txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetSignatureMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -490,7 +602,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetSignatureMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -537,12 +649,13 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+void CTransactionLock::AddSignature(const CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    mapHeightSignatures[cv.nBlockHeight]++;
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -551,11 +664,6 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
-        if (v.nBlockHeight == nBlockHeight) {
-            n++;
-        }
-    }
-    return n;
+    std::map<int, int>::const_iterator it = mapHeightSignatures.find(nBlockHeight);
+    return it == mapHeightSignatures.end() ? 0 : it->second;
 }
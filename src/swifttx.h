@@ -15,6 +15,8 @@
 #include "sync.h"
 #include "util.h"
 
+#include <set>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of SwiftX
@@ -33,14 +35,11 @@ using namespace boost;
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
+class CTxLockManager;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
+extern CTxLockManager txLockManager;
 extern int nCompleteTXLocks;
 
 
@@ -48,9 +47,6 @@ int64_t CreateNewLock(CTransaction tx);
 
 bool IsIXTXValid(const CTransaction& txCollateral);
 
-// if two conflicting locks are approved by the network, they will cancel out
-bool CheckForConflictingLocks(CTransaction& tx);
-
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
@@ -59,11 +55,6 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 //process consensus vote message
 bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
 
-// keep transaction locks in memory for an hour
-void CleanTransactionLocksList();
-
-int64_t GetAverageVoteTime();
-
 class CConsensusVote
 {
 public:
@@ -74,6 +65,7 @@ public:
 
     uint256 GetHash() const;
 
+    std::string GetSignatureMessage();
     bool SignatureValid();
     bool Sign();
 
@@ -95,12 +87,14 @@ public:
     int nBlockHeight;
     uint256 txHash;
     std::vector<CConsensusVote> vecConsensusVotes;
+    // number of votes cast for each block height
+    std::map<int, int> mapHeightSignatures;
     int nExpiration;
     int nTimeout;
 
     bool SignaturesValid();
-    int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    int CountSignatures() const;
+    void AddSignature(const CConsensusVote& cv);
 
     uint256 GetHash()
     {
@@ -108,5 +102,75 @@ public:
     }
 };
 
+/**
+ * SwiftX lock state: the lock requests and votes seen, the lock being
+ * assembled for each transaction and the inputs the complete locks hold.
+ * Has its own lock so block and mempool checks don't need cs_main to look
+ * at the locked inputs; locks are kept ordered by expiration as well, so
+ * CheckAndRemove only visits the expired ones.
+ */
+class CTxLockManager
+{
+private:
+    // critical section to protect the inner data structures
+    mutable CCriticalSection cs;
+
+    std::map<uint256, CTransaction> mapTxLockReq;
+    std::map<uint256, CTransaction> mapTxLockReqRejected;
+    std::map<uint256, CConsensusVote> mapTxLockVote;
+    std::map<uint256, CTransactionLock> mapTxLocks;
+    // input -> transaction holding the lock on it
+    std::map<COutPoint, uint256> mapLockedInputs;
+    // (expiration, tx hash) of every entry of mapTxLocks
+    std::set<std::pair<int64_t, uint256> > setLockExpirations;
+    //track votes with no tx for DOS
+    std::map<uint256, int64_t> mapUnknownVotes;
+    int64_t nUnknownVoteTimeTotal;
+
+    CTransactionLock& GetOrCreateLock(const uint256& txHash);
+    void SetExpiration(CTransactionLock& lock, int64_t nExpiration);
+    void SetUnknownVoteTime(const uint256& hash, int64_t nTime);
+    int64_t GetAverageVoteTime() const;
+    void LockInputs(const CTransaction& tx);
+
+public:
+    CTxLockManager() : nUnknownVoteTimeTotal(0) {}
+
+    bool HaveTxLockRequest(const uint256& txHash) const;
+    bool GetTxLockRequest(const uint256& txHash, CTransaction& txRet) const;
+    void AddTxLockRequest(const CTransaction& tx);
+    /// Remember a request we couldn't accept and hold its inputs that aren't locked yet
+    void AddRejectedTxLockRequest(const CTransaction& tx);
+
+    bool HaveTxLockVote(const uint256& hash) const;
+    bool GetTxLockVote(const uint256& hash, CConsensusVote& voteRet) const;
+    /// Returns false if the vote was already known
+    bool AddTxLockVote(const CConsensusVote& vote);
+    /// Whether a masternode votes on unknown transactions faster than the network does
+    bool IsUnknownVoteSpam(const CConsensusVote& vote);
+
+    /// Set the block height the votes for txHash must be cast for, creating its lock if needed
+    void SetLockHeight(const uint256& txHash, int nBlockHeight);
+    /// Add a valid vote to its lock and return the lock's signature count
+    int AddSignature(const CConsensusVote& vote);
+    /// Signatures of the lock on txHash, -1 if there is none or its block height isn't known yet
+    int GetSignatures(const uint256& txHash) const;
+    bool IsTimedOut(const uint256& txHash) const;
+
+    /**
+     * Hold the inputs of a complete lock. Returns false if the lock conflicts
+     * with another complete lock; fRejectedRet tells whether we had rejected
+     * the transaction, so blocks may need to be reprocessed.
+     */
+    bool CompleteLock(const uint256& txHash, bool& fRejectedRet);
+    // if two conflicting locks are approved by the network, they will cancel out
+    bool CheckForConflictingLocks(const CTransaction& tx);
+    /// Whether an input of tx is locked by another transaction
+    bool HasConflictingLock(const CTransaction& tx, uint256& hashLockRet) const;
+
+    // keep transaction locks in memory for an hour
+    void CheckAndRemove();
+};
+
 
 #endif
@@ -29,13 +29,24 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytesPerPeer);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nTxSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+struct IteratorComparator
+{
+    template<typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+extern std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, size_t> mapOrphanBytesByPeer;
 
 CService ip(uint32_t i)
 {
@@ -196,11 +207,60 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, DEFAULT_MAX_ORPHAN_BYTES_PER_PEER);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, DEFAULT_MAX_ORPHAN_BYTES_PER_PEER);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, DEFAULT_MAX_ORPHAN_BYTES_PER_PEER);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanBytesByPeer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansPerPeerBytes)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    // Two orphans spending different outputs of the same missing parent
+    // are indexed by outpoint, not just by parent hash:
+    uint256 hashParent = GetRandHash();
+    size_t nTxSize = 0;
+    for (unsigned int n = 0; n < 2; n++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(hashParent, n);
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        nTxSize = ::GetSerializeSize(tx, SER_NETWORK, tx.nVersion);
+    }
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev.size(), 2U);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[COutPoint(hashParent, 0)].size(), 1U);
+    BOOST_CHECK_EQUAL(mapOrphanBytesByPeer[0], 2 * nTxSize);
+
+    // Peer 1 floods us with orphans, peer 0 keeps its own:
+    for (int i = 0; i < 20; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        BOOST_CHECK(AddOrphanTx(tx, 1));
+    }
+    LimitOrphanTxSize(DEFAULT_MAX_ORPHAN_TRANSACTIONS, 5 * nTxSize);
+    BOOST_CHECK(mapOrphanBytesByPeer[1] <= 5 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanBytesByPeer[0], 2 * nTxSize);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 7U);
+
+    EraseOrphansFor(0);
+    EraseOrphansFor(1);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
@@ -123,4 +123,58 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block)
+{
+    const CChainParams& chainparams = Params();
+    CBlockIndex* pindex = chainActive.Tip();
+    BOOST_REQUIRE(pindex != NULL);
+
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+
+    // The raw bytes served to peers are the block as it would be serialized
+    std::vector<unsigned char> vRawBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(vRawBlock, pindex->GetBlockPos(), pindex->GetBlockHash(), chainparams.MessageStart()));
+    BOOST_CHECK(vRawBlock.size() == ssBlock.size() && memcmp(vRawBlock.data(), &ssBlock[0], ssBlock.size()) == 0);
+
+    // and are not served under another block's hash
+    BOOST_CHECK(!ReadRawBlockFromDisk(vRawBlock, pindex->GetBlockPos(), GetRandHash(), chainparams.MessageStart()));
+}
+
+BOOST_AUTO_TEST_CASE(block_download_rate)
+{
+    CBlockDownloadRate rate;
+    BOOST_CHECK_EQUAL(rate.GetInFlightLimit(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(rate.GetDownloadWindow(), (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // A fast peer is allowed more blocks in flight and a wider window, up to the caps
+    int64_t nTime = 1000000;
+    for (int i = 0; i < 100; i++) {
+        nTime += 1000;
+        rate.AddDelivery(nTime - 1000, nTime);
+    }
+    BOOST_CHECK_EQUAL(rate.GetAvgDeliveryMicros(), 1000);
+    BOOST_CHECK_EQUAL(rate.GetInFlightLimit(), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(rate.GetDownloadWindow(), (int)MAX_BLOCK_DOWNLOAD_WINDOW);
+
+    // Slowing down shrinks both again, in steps
+    nTime += 2 * BLOCK_DOWNLOAD_INFLIGHT_TARGET;
+    rate.AddDelivery(0, nTime);
+    int nLimit = rate.GetInFlightLimit();
+    BOOST_CHECK(nLimit < MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER && nLimit > MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    for (int i = 0; i < 100; i++) {
+        nTime += BLOCK_DOWNLOAD_INFLIGHT_TARGET;
+        rate.AddDelivery(0, nTime);
+    }
+    BOOST_CHECK_EQUAL(rate.GetInFlightLimit(), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(rate.GetDownloadWindow(), (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // A lone request is measured from when it was sent, not from the previous delivery
+    CBlockDownloadRate rate2;
+    rate2.AddDelivery(nTime - 500, nTime);
+    BOOST_CHECK_EQUAL(rate2.GetAvgDeliveryMicros(), 500);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
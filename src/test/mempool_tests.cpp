@@ -14,6 +14,16 @@
 
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
 
+static void CheckAncestorOrder(CTxMemPool &pool, const std::vector<std::string> &sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    CTxMemPool::indexed_transaction_set::nth_index<2>::type::iterator it = pool.mapTx.get<2>().begin();
+    int count = 0;
+    for (; it != pool.mapTx.get<2>().end(); ++it, ++count) {
+        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[count]);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 {
     // Test CTxMemPool::remove functionality
@@ -157,6 +167,258 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    /* 3rd highest fee */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    /* highest fee */
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(20000LL).FromTx(tx2));
+
+    /* lowest fee */
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(0LL).FromTx(tx3));
+
+    /* 2nd highest fee */
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 6 * COIN;
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(15000LL).FromTx(tx4));
+
+    /* equal fee rate to tx1, but newer */
+    CMutableTransaction tx5 = CMutableTransaction();
+    tx5.vout.resize(1);
+    tx5.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx5.vout[0].nValue = 11 * COIN;
+    pool.addUnchecked(tx5.GetHash(), entry.Fee(10000LL).FromTx(tx5));
+    BOOST_CHECK_EQUAL(pool.size(), 5);
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.resize(5);
+    sortedOrder[0] = tx2.GetHash().ToString(); // 20000
+    sortedOrder[1] = tx4.GetHash().ToString(); // 15000
+    // tx1 and tx5 are both 10000
+    // Ties are broken by hash, not timestamp, so determine which
+    // hash comes first.
+    if (tx1.GetHash() < tx5.GetHash()) {
+        sortedOrder[2] = tx1.GetHash().ToString();
+        sortedOrder[3] = tx5.GetHash().ToString();
+    } else {
+        sortedOrder[2] = tx5.GetHash().ToString();
+        sortedOrder[3] = tx1.GetHash().ToString();
+    }
+    sortedOrder[4] = tx3.GetHash().ToString(); // 0
+
+    CheckAncestorOrder(pool, sortedOrder);
+
+    /* low fee parent with high fee child */
+    /* tx6 (0) -> tx7 (high) */
+    CMutableTransaction tx6 = CMutableTransaction();
+    tx6.vout.resize(1);
+    tx6.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx6.vout[0].nValue = 20 * COIN;
+    uint64_t tx6Size = ::GetSerializeSize(tx6, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(0LL).FromTx(tx6));
+    BOOST_CHECK_EQUAL(pool.size(), 6);
+    // Ties are broken by hash
+    if (tx3.GetHash() < tx6.GetHash())
+        sortedOrder.push_back(tx6.GetHash().ToString());
+    else
+        sortedOrder.insert(sortedOrder.end()-1, tx6.GetHash().ToString());
+
+    CheckAncestorOrder(pool, sortedOrder);
+
+    CMutableTransaction tx7 = CMutableTransaction();
+    tx7.vin.resize(1);
+    tx7.vin[0].prevout = COutPoint(tx6.GetHash(), 0);
+    tx7.vin[0].scriptSig = CScript() << OP_11;
+    tx7.vout.resize(1);
+    tx7.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx7.vout[0].nValue = 10 * COIN;
+    uint64_t tx7Size = ::GetSerializeSize(tx7, SER_NETWORK, PROTOCOL_VERSION);
+
+    /* set the fee to just below tx2's feerate when including ancestor */
+    CAmount fee = (20000/::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION))*(tx7Size + tx6Size) - 1;
+
+    pool.addUnchecked(tx7.GetHash(), entry.Fee(fee).FromTx(tx7));
+    BOOST_CHECK_EQUAL(pool.size(), 7);
+    sortedOrder.insert(sortedOrder.begin()+1, tx7.GetHash().ToString());
+    CheckAncestorOrder(pool, sortedOrder);
+
+    /* after tx6 is mined, tx7 should move up in the sort */
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx6);
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vtx, 1, dummy, false);
+
+    sortedOrder.erase(sortedOrder.begin()+1);
+    // Ties are broken by hash
+    if (tx3.GetHash() < tx6.GetHash())
+        sortedOrder.pop_back();
+    else
+        sortedOrder.erase(sortedOrder.end()-2);
+    sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
+    CheckAncestorOrder(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A parent with two children, one of which has a child of its own:
+    // txParent -> txChild[0] -> txGrandChild
+    //          -> txChild[1]
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout.hash = txParent.GetHash();
+        txChild[i].vin[0].prevout.n = i;
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+    }
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild[0].GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+
+    uint64_t nParentSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nChildSize = ::GetSerializeSize(txChild[0], SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nGrandChildSize = ::GetSerializeSize(txGrandChild, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txChild[0].GetHash(), entry.Fee(2000LL).FromTx(txChild[0]));
+    pool.addUnchecked(txChild[1].GetHash(), entry.Fee(3000LL).FromTx(txChild[1]));
+    pool.addUnchecked(txGrandChild.GetHash(), entry.Fee(4000LL).FromTx(txGrandChild));
+
+    CTxMemPool::txiter parentIt = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(parentIt->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(parentIt->GetSizeWithDescendants(), nParentSize + 2 * nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(parentIt->GetModFeesWithDescendants(), 10000LL);
+    BOOST_CHECK_EQUAL(parentIt->GetCountWithAncestors(), 1);
+
+    CTxMemPool::txiter grandChildIt = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(grandChildIt->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandChildIt->GetSizeWithAncestors(), nParentSize + nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(grandChildIt->GetModFeesWithAncestors(), 7000LL);
+    BOOST_CHECK_EQUAL(grandChildIt->GetCountWithDescendants(), 1);
+
+    // Prioritising the grandchild is reflected in its ancestors' descendant state.
+    pool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0, 500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txParent.GetHash())->GetModFeesWithDescendants(), 10500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txChild[0].GetHash())->GetModFeesWithDescendants(), 6500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetModFeesWithAncestors(), 7500LL);
+
+    // Mining the parent leaves the children behind without it as an ancestor.
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts, false);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txChild[1].GetHash())->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetModFeesWithAncestors(), 6500LL);
+
+    // Putting the parent back (as in a reorg) relinks its in-mempool children.
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txParent.GetHash())->GetModFeesWithDescendants(), 10500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txChild[1].GetHash())->GetSizeWithAncestors(), nParentSize + nChildSize);
+
+    // Removing a child recursively updates the parent's descendant state.
+    std::list<CTransaction> removed;
+    pool.remove(txChild[0], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txParent.GetHash())->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txParent.GetHash())->GetModFeesWithDescendants(), 4000LL);
+
+    // Ancestor limits are enforced by CalculateMemPoolAncestors.
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CMutableTransaction txNephew;
+    txNephew.vin.resize(1);
+    txNephew.vin[0].scriptSig = CScript() << OP_11;
+    txNephew.vin[0].prevout.hash = txChild[1].GetHash();
+    txNephew.vin[0].prevout.n = 0;
+    txNephew.vout.resize(1);
+    txNephew.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txNephew.vout[0].nValue = 10000LL;
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(txNephew), setAncestors, 100, 1000000, 100, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txNephew), setAncestors, 2, 1000000, 100, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txNephew), setAncestors, 100, 1000000, 2, 1000000, errString));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolQueryHashesByAncestorScoreTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A zero-fee parent with a high-fee child, and an unrelated low-fee tx.
+    CMutableTransaction txParent;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 9 * COIN;
+    CMutableTransaction txOther;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 5 * COIN;
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0LL).FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(100000LL).FromTx(txChild));
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(1000LL).FromTx(txOther));
+
+    // The child's package outbids txOther, and the parent comes first.
+    std::vector<uint256> vtxid;
+    pool.queryHashesByAncestorScore(vtxid);
+    BOOST_CHECK_EQUAL(vtxid.size(), 3);
+    BOOST_CHECK(vtxid[0] == txParent.GetHash());
+    BOOST_CHECK(vtxid[1] == txChild.GetHash());
+    BOOST_CHECK(vtxid[2] == txOther.GetHash());
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -222,4 +484,47 @@ BOOST_AUTO_TEST_CASE(SetSanityCheck) {
     BOOST_CHECK_EQUAL(pool.GetCheckFrequency(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolMinFeeTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    pool.SetMempoolCostLimit(3 * MIN_TX_COST, 60);
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    BOOST_CHECK(pool.GetMinFee() == CFeeRate(0));
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    CFeeRate feeRate;
+    BOOST_CHECK(pool.lookupFeeRate(tx1.GetHash(), feeRate));
+    BOOST_CHECK(feeRate == CFeeRate(10000LL, ::GetSerializeSize(tx1, SER_NETWORK, PROTOCOL_VERSION)));
+    BOOST_CHECK(!pool.lookupFeeRate(uint256(), feeRate));
+
+    // Well below the cost limit nothing is filtered
+    BOOST_CHECK(pool.GetMinFee() == CFeeRate(0));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(10000LL).FromTx(tx2));
+    BOOST_CHECK(pool.GetMinFee() == CFeeRate(0));
+
+    // Close to the limit, ask for the fee that avoids the low fee penalty
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(10000LL).FromTx(tx3));
+    BOOST_CHECK(pool.GetMinFee() == CFeeRate(DEFAULT_FEE, MIN_TX_COST));
+
+    std::list<CTransaction> removed;
+    pool.remove(tx3, removed, true);
+    BOOST_CHECK(pool.GetMinFee() == CFeeRate(0));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
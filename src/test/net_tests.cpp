@@ -133,4 +133,138 @@ BOOST_AUTO_TEST_CASE(caddrdb_read_corrupted)
     BOOST_CHECK(addrman2.size() == 0);
 }
 
+BOOST_AUTO_TEST_CASE(socketevents_mode_strings)
+{
+    SocketEventsMode mode;
+    BOOST_CHECK(SocketEventsModeFromString("select", mode));
+    BOOST_CHECK(mode == SOCKETEVENTS_SELECT);
+    BOOST_CHECK(!SocketEventsModeFromString("kqueue", mode));
+    BOOST_CHECK(!SocketEventsModeFromString("", mode));
+
+    // The default is always one of the compiled in modes
+    BOOST_CHECK(SocketEventsModeFromString(SocketEventsModeToString(DEFAULT_SOCKETEVENTS), mode));
+    BOOST_CHECK(mode == DEFAULT_SOCKETEVENTS);
+    BOOST_CHECK(GetSupportedSocketEventsModes().find(SocketEventsModeToString(DEFAULT_SOCKETEVENTS)) != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_incremental_checksum)
+{
+    std::vector<char> payload(100 * 1000);
+    for (size_t i = 0; i < payload.size(); i++)
+        payload[i] = (char)(i * 7);
+
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << CMessageHeader(Params().MessageStart(), "block", payload.size());
+    BOOST_CHECK_EQUAL(ssHeader.size(), 24U);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msg.readHeader(&ssHeader[0], ssHeader.size()), 24);
+    BOOST_CHECK(!msg.complete());
+
+    // Feed the payload in uneven pieces, as the socket would
+    size_t nPos = 0;
+    while (nPos < payload.size()) {
+        unsigned int nChunk = std::min(payload.size() - nPos, (size_t)1337);
+        BOOST_CHECK_EQUAL(msg.readData(&payload[nPos], nChunk), (int)nChunk);
+        nPos += nChunk;
+    }
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.GetMessageHash() == Hash(payload.begin(), payload.end()));
+    BOOST_CHECK(msg.vRecv.size() == payload.size() && std::equal(payload.begin(), payload.end(), msg.vRecv.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CRecvBufferPool pool;
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+
+    // Nothing pooled yet, and small buffers are never pooled
+    BOOST_CHECK(!pool.Get(64 * 1024, stream));
+    stream.reserve(100);
+    pool.Put(stream);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    stream.reserve(100 * 1000);
+    stream << 42;
+    size_t nCapacity = stream.capacity();
+    pool.Put(stream);
+    BOOST_CHECK_EQUAL(stream.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nCapacity);
+
+    // Too small for a bigger request, but handed out empty for one that fits
+    BOOST_CHECK(!pool.Get(nCapacity + 1, stream));
+    BOOST_CHECK(pool.Get(nCapacity, stream));
+    BOOST_CHECK(stream.empty());
+    BOOST_CHECK_EQUAL(stream.capacity(), nCapacity);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // A partly read stream returns its whole buffer
+    stream << 42 << 43;
+    int n;
+    stream >> n;
+    pool.Put(stream);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nCapacity);
+    BOOST_CHECK(pool.Get(nCapacity, stream));
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // The pool frees what it has no room for
+    for (size_t i = 0; i < CRecvBufferPool::RECV_BUFFER_POOL_MAX_BYTES / MAX_PROTOCOL_MESSAGE_LENGTH + 1; i++) {
+        CDataStream big(SER_NETWORK, PROTOCOL_VERSION);
+        big.reserve(MAX_PROTOCOL_MESSAGE_LENGTH);
+        pool.Put(big);
+    }
+    BOOST_CHECK(pool.GetPooledBytes() <= CRecvBufferPool::RECV_BUFFER_POOL_MAX_BYTES);
+}
+
+BOOST_AUTO_TEST_CASE(queue_wait_histogram)
+{
+    CQueueWaitHistogram histogram;
+    histogram.Add(-5);           // clock skew counts as no wait
+    histogram.Add(999);          // < 1ms
+    histogram.Add(1000);         // [1ms, 2ms)
+    histogram.Add(3000);         // [2ms, 4ms)
+    histogram.Add(int64_t(1) << 40); // past the last bound
+
+    std::vector<uint64_t> vCounts;
+    uint64_t nTotalMicros;
+    histogram.GetCounts(vCounts, nTotalMicros);
+    BOOST_CHECK_EQUAL(vCounts.size(), CQueueWaitHistogram::BUCKETS);
+    BOOST_CHECK_EQUAL(vCounts[0], 2U);
+    BOOST_CHECK_EQUAL(vCounts[1], 1U);
+    BOOST_CHECK_EQUAL(vCounts[2], 1U);
+    BOOST_CHECK_EQUAL(vCounts[CQueueWaitHistogram::BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(nTotalMicros, 999U + 1000U + 3000U + (uint64_t(1) << 40));
+    BOOST_CHECK_EQUAL(CQueueWaitHistogram::BucketLimitMillis(0), 1);
+    BOOST_CHECK_EQUAL(CQueueWaitHistogram::BucketLimitMillis(CQueueWaitHistogram::BUCKETS - 1), -1);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_known_by_type)
+{
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    uint256 hash = GetRandHash();
+
+    // The same hash under another inventory type is still announced
+    node.AddInventoryKnown(CInv(MSG_TX, hash));
+    BOOST_CHECK(node.HasInventoryKnown(CInv(MSG_TX, hash)));
+    BOOST_CHECK(!node.HasInventoryKnown(CInv(MSG_DSTX, hash)));
+    BOOST_CHECK(!node.HasInventoryKnown(CInv(MSG_TXLOCK_REQUEST, hash)));
+
+    node.PushInventory(CInv(MSG_TX, hash));
+    node.PushInventory(CInv(MSG_DSTX, hash));
+    LOCK(node.cs_inventory);
+    BOOST_CHECK_EQUAL(node.vInventoryToSend.size(), 1U);
+    BOOST_CHECK(node.vInventoryToSend[0].type == MSG_DSTX);
+}
+
+BOOST_AUTO_TEST_CASE(net_message_types)
+{
+    const std::vector<std::string>& vTypes = getAllNetMessageTypes();
+    BOOST_CHECK(std::is_sorted(vTypes.begin(), vTypes.end()));
+    BOOST_CHECK(std::adjacent_find(vTypes.begin(), vTypes.end()) == vTypes.end());
+    for (const std::string& strType : vTypes)
+        BOOST_CHECK(strType.size() <= CMessageHeader::COMMAND_SIZE);
+    BOOST_CHECK(std::find(vTypes.begin(), vTypes.end(), NET_MESSAGE_COMMAND_OTHER) == vTypes.end());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,173 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recordlog.h"
+#include "arith_uint256.h"
+#include "util.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(recordlog_tests, TestingSetup)
+
+static std::map<uint256, int> ReplayMap(const std::string& strFilename, CRecordLogIndex& index)
+{
+    std::map<uint256, int> mapOut;
+    CRecordLog log(strFilename, "RecordLogTest");
+    BOOST_CHECK(log.Replay([&](unsigned char nType, CDataStream& ss) {
+        if (nType == 1) {
+            std::pair<uint256, int> entry;
+            ss >> entry;
+            mapOut[entry.first] = entry.second;
+            index.Logged(entry.first, entry.second);
+        } else if (nType == 2) {
+            uint256 hash;
+            ss >> hash;
+            mapOut.erase(hash);
+            index.Erased(hash);
+        }
+    }) == CRecordLog::Ok);
+    return mapOut;
+}
+
+BOOST_AUTO_TEST_CASE(recordlog_replay)
+{
+    CRecordLog log("recordlog_replay.dat", "RecordLogTest");
+    for (int i = 0; i < 10; i++)
+        log.Append(1, i);
+    BOOST_CHECK(log.Flush());
+    for (int i = 10; i < 20; i++)
+        log.Append(1, i);
+    BOOST_CHECK(log.Flush());
+
+    std::vector<int> vRead;
+    CRecordLog log2("recordlog_replay.dat", "RecordLogTest");
+    BOOST_CHECK(log2.Replay([&](unsigned char nType, CDataStream& ss) {
+        BOOST_CHECK_EQUAL(nType, 1);
+        int n;
+        ss >> n;
+        vRead.push_back(n);
+    }) == CRecordLog::Ok);
+    BOOST_CHECK_EQUAL(vRead.size(), 20U);
+    for (int i = 0; i < (int)vRead.size(); i++)
+        BOOST_CHECK_EQUAL(vRead[i], i);
+
+    CRecordLog log3("recordlog_replay.dat", "OtherMagic");
+    BOOST_CHECK(log3.Replay([](unsigned char, CDataStream&) {}) == CRecordLog::IncorrectMagicMessage);
+
+    CRecordLog log4("recordlog_missing.dat", "RecordLogTest");
+    BOOST_CHECK(log4.Replay([](unsigned char, CDataStream&) {}) == CRecordLog::FileError);
+}
+
+BOOST_AUTO_TEST_CASE(recordlog_damaged_tail)
+{
+    CRecordLog log("recordlog_damaged.dat", "RecordLogTest");
+    for (int i = 0; i < 5; i++)
+        log.Append(1, i);
+    BOOST_CHECK(log.Flush());
+    uint64_t nIntactSize = log.GetFileSize();
+
+    // a record cut short by a crash
+    boost::filesystem::path path = GetDataDir() / "recordlog_damaged.dat";
+    FILE* file = fopen(path.string().c_str(), "ab");
+    const unsigned char pchPartial[] = {0x40, 0x00, 0x00, 0x00, 0x12, 0x34};
+    BOOST_CHECK_EQUAL(fwrite(pchPartial, 1, sizeof(pchPartial), file), sizeof(pchPartial));
+    fclose(file);
+
+    int nRead = 0;
+    CRecordLog log2("recordlog_damaged.dat", "RecordLogTest");
+    BOOST_CHECK(log2.Replay([&](unsigned char, CDataStream&) { nRead++; }) == CRecordLog::Ok);
+    BOOST_CHECK_EQUAL(nRead, 5);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nIntactSize);
+
+    // records appended after the cut are found again
+    log2.Append(1, 5);
+    BOOST_CHECK(log2.Flush());
+    nRead = 0;
+    CRecordLog log3("recordlog_damaged.dat", "RecordLogTest");
+    BOOST_CHECK(log3.Replay([&](unsigned char, CDataStream&) { nRead++; }) == CRecordLog::Ok);
+    BOOST_CHECK_EQUAL(nRead, 6);
+}
+
+BOOST_AUTO_TEST_CASE(recordlog_flush_failure)
+{
+    CRecordLog log("recordlog_failure.dat", "RecordLogTest");
+    log.Append(1, 1);
+    BOOST_CHECK(log.Flush());
+    BOOST_CHECK(!log.NeedsRewrite(log.GetFileSize()));
+
+    // the file can't be opened for appending
+    boost::filesystem::path path = GetDataDir() / "recordlog_failure.dat";
+    boost::filesystem::remove(path);
+    boost::filesystem::create_directory(path);
+    log.Append(1, 2);
+    BOOST_CHECK(!log.Flush());
+    BOOST_CHECK(log.NeedsRewrite(log.GetFileSize()));
+
+    // the owner writes everything over
+    boost::filesystem::remove(path);
+    log.Append(1, 1);
+    log.Append(1, 2);
+    BOOST_CHECK(log.Flush());
+    std::vector<int> vRead;
+    CRecordLog log2("recordlog_failure.dat", "RecordLogTest");
+    BOOST_CHECK(log2.Replay([&](unsigned char, CDataStream& ss) {
+        int n;
+        ss >> n;
+        vRead.push_back(n);
+    }) == CRecordLog::Ok);
+    BOOST_CHECK(vRead == std::vector<int>({1, 2}));
+}
+
+BOOST_AUTO_TEST_CASE(recordlog_index)
+{
+    std::map<uint256, int> mapLive;
+    for (int i = 0; i < 100; i++)
+        mapLive[ArithToUint256(arith_uint256(i))] = i;
+
+    CRecordLog log("recordlog_index.dat", "RecordLogTest");
+    CRecordLogIndex index;
+    index.AppendChanges(log, 1, 2, mapLive);
+    BOOST_CHECK(log.Flush());
+    uint64_t nSize = log.GetFileSize();
+
+    // nothing changed, nothing written
+    index.AppendChanges(log, 1, 2, mapLive);
+    BOOST_CHECK_EQUAL(log.GetFileSize(), nSize);
+
+    for (int i = 0; i < 100; i += 2)
+        mapLive.erase(ArithToUint256(arith_uint256(i)));
+    for (int i = 100; i < 110; i++)
+        mapLive[ArithToUint256(arith_uint256(i))] = i;
+    index.AppendChanges(log, 1, 2, mapLive);
+    BOOST_CHECK(log.Flush());
+
+    CRecordLogIndex index2;
+    BOOST_CHECK(ReplayMap("recordlog_index.dat", index2) == mapLive);
+    BOOST_CHECK_EQUAL(index2.GetLiveSize(), index.GetLiveSize());
+
+    // a rewrite keeps only the live entries
+    log.Reset();
+    index.AppendAll(log, 1, mapLive);
+    BOOST_CHECK(log.Flush());
+    BOOST_CHECK(log.GetFileSize() < nSize);
+    CRecordLogIndex index3;
+    BOOST_CHECK(ReplayMap("recordlog_index.dat", index3) == mapLive);
+
+    // entries held by pointer are logged as the values
+    std::map<uint256, const int*> mapPointers;
+    for (std::map<uint256, int>::iterator it = mapLive.begin(); it != mapLive.end(); ++it)
+        mapPointers[it->first] = &it->second;
+    mapPointers.erase(mapPointers.begin());
+    index.AppendChanges(log, 1, 2, mapPointers);
+    BOOST_CHECK(log.Flush());
+    mapLive.erase(mapLive.begin());
+    CRecordLogIndex index4;
+    BOOST_CHECK(ReplayMap("recordlog_index.dat", index4) == mapLive);
+    BOOST_CHECK_EQUAL(index4.GetLiveSize(), index.GetLiveSize());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
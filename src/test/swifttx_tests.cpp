@@ -0,0 +1,125 @@
+// Copyright (c) 2017-2018 The SnowGem developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "swifttx.h"
+#include "primitives/transaction.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(swifttx_tests, TestingSetup)
+
+static CTransaction LockTransaction(const uint256& hashPrev, unsigned int nOut)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(hashPrev, nOut);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = nOut + 1;
+    return CTransaction(mtx);
+}
+
+static CConsensusVote LockVote(const uint256& txHash, int nBlockHeight, unsigned int nMasternode)
+{
+    CConsensusVote vote;
+    vote.vinMasternode = CTxIn(COutPoint(GetRandHash(), nMasternode));
+    vote.txHash = txHash;
+    vote.nBlockHeight = nBlockHeight;
+    return vote;
+}
+
+BOOST_AUTO_TEST_CASE(swifttx_signatures)
+{
+    CTxLockManager manager;
+    CTransaction tx = LockTransaction(GetRandHash(), 0);
+
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx.GetHash()), -1);
+
+    // votes arriving before the lock height is known don't count yet
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK_EQUAL(manager.AddSignature(LockVote(tx.GetHash(), 100, i)), -1);
+    manager.AddSignature(LockVote(tx.GetHash(), 99, 3));
+
+    manager.SetLockHeight(tx.GetHash(), 100);
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx.GetHash()), 3);
+    BOOST_CHECK_EQUAL(manager.AddSignature(LockVote(tx.GetHash(), 100, 4)), 4);
+
+    manager.SetLockHeight(tx.GetHash(), 99);
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx.GetHash()), 1);
+
+    CConsensusVote vote = LockVote(tx.GetHash(), 100, 5);
+    BOOST_CHECK(manager.AddTxLockVote(vote));
+    BOOST_CHECK(!manager.AddTxLockVote(vote));
+    BOOST_CHECK(manager.HaveTxLockVote(vote.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(swifttx_conflicts)
+{
+    CTxLockManager manager;
+    uint256 hashPrev = GetRandHash();
+    CTransaction tx1 = LockTransaction(hashPrev, 0);
+    CTransaction tx2b = LockTransaction(hashPrev, 1);
+
+    // tx2 spends the same input with a different output
+    CMutableTransaction mtx(tx1);
+    mtx.vout[0].nValue = 42;
+    CTransaction tx2(mtx);
+
+    manager.AddTxLockRequest(tx1);
+    manager.SetLockHeight(tx1.GetHash(), 100);
+    bool fRejected = true;
+    BOOST_CHECK(manager.CompleteLock(tx1.GetHash(), fRejected));
+    BOOST_CHECK(!fRejected);
+
+    uint256 hashLock;
+    BOOST_CHECK(!manager.HasConflictingLock(tx1, hashLock));
+    BOOST_CHECK(!manager.HasConflictingLock(tx2b, hashLock));
+    BOOST_CHECK(manager.HasConflictingLock(tx2, hashLock));
+    BOOST_CHECK(hashLock == tx1.GetHash());
+
+    manager.AddTxLockRequest(tx2);
+    manager.SetLockHeight(tx2.GetHash(), 100);
+    BOOST_CHECK(!manager.CompleteLock(tx2.GetHash(), fRejected));
+}
+
+BOOST_AUTO_TEST_CASE(swifttx_expiration)
+{
+    CTxLockManager manager;
+    CTransaction tx1 = LockTransaction(GetRandHash(), 0);
+    CTransaction tx2 = LockTransaction(GetRandHash(), 0);
+    int64_t nTime = GetTime();
+
+    SetMockTime(nTime);
+    manager.AddTxLockRequest(tx1);
+    manager.SetLockHeight(tx1.GetHash(), 100);
+    bool fRejected;
+    BOOST_CHECK(manager.CompleteLock(tx1.GetHash(), fRejected));
+
+    SetMockTime(nTime + 30 * 60);
+    manager.AddTxLockRequest(tx2);
+    manager.SetLockHeight(tx2.GetHash(), 100);
+
+    SetMockTime(nTime + 60 * 60 + 1);
+    BOOST_CHECK(manager.IsTimedOut(tx1.GetHash()));
+    manager.CheckAndRemove();
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx1.GetHash()), -1);
+    BOOST_CHECK(!manager.HaveTxLockRequest(tx1.GetHash()));
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx2.GetHash()), 0);
+
+    // the inputs of an expired lock are free again
+    CMutableTransaction mtx(tx1);
+    mtx.vout[0].nValue = 42;
+    uint256 hashLock;
+    BOOST_CHECK(!manager.HasConflictingLock(CTransaction(mtx), hashLock));
+
+    SetMockTime(nTime + 90 * 60 + 1);
+    manager.CheckAndRemove();
+    BOOST_CHECK_EQUAL(manager.GetSignatures(tx2.GetHash()), -1);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
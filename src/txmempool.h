@@ -7,6 +7,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -18,6 +19,8 @@
 #include "spentindex.h"
 
 #undef foreach
+#include <boost/unordered_map.hpp>
+
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
@@ -36,6 +39,21 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
+/** Salted hasher for the mempool's insight spent index, which is keyed like an outpoint */
+class SaltedSpentIndexKeyHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedSpentIndexKeyHasher();
+
+    size_t operator()(const CSpentIndexKey& key) const {
+        return SipHashUint256Extra(k0, k1, key.txid, key.outputIndex);
+    }
+};
+
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
@@ -57,6 +75,20 @@ private:
     bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
     bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
     uint32_t nBranchId;        //!< Branch ID this transaction is known to commit to, cached for efficiency
+    CAmount nFeeDelta;         //!< Fee delta applied by PrioritiseTransaction, used when mining
+
+    // Information about descendants of this transaction that are in the
+    // mempool; if we remove this transaction we must remove all of these
+    // descendants as well. All of these values include this transaction.
+    uint64_t nCountWithDescendants;  //!< number of descendant transactions
+    uint64_t nSizeWithDescendants;   //!< ... and size
+    CAmount nModFeesWithDescendants; //!< ... and total fees (including fee deltas)
+
+    // Analogous statistics for ancestor transactions, used by the miner to
+    // select transactions by the fee rate of the package they complete.
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -77,6 +109,65 @@ public:
 
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
     uint32_t GetValidatedBranchId() const { return nBranchId; }
+
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+
+    // Adjusts the descendant state
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    // Adjusts the ancestor state
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    // Updates the fee delta used for mining priority score, and the
+    // modified fees with descendants/ancestors.
+    void UpdateFeeDelta(CAmount feeDelta);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
 };
 
 // extracts a TxMemPoolEntry's transaction hash
@@ -92,7 +183,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         if (a.GetFeeRate() == b.GetFeeRate())
             return a.GetTime() < b.GetTime();
@@ -100,6 +191,23 @@ public:
     }
 };
 
+/** Sort an entry by min(score/size of entry's tx, score/size with all ancestors). */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+
+        if (f1 == f2) {
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 > f2;
+    }
+};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -125,6 +233,19 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Every entry tracks the in-mempool transactions it depends on (ancestors)
+ * and the in-mempool transactions depending on it (descendants). The
+ * aggregate count, size and modified fees of both sets are cached in the
+ * entry and kept up to date incrementally as transactions enter and leave
+ * the pool; parent/child links are kept in mapLinks. The miner uses the
+ * ancestor state (index 2 of mapTx) to select transactions by the fee rate
+ * of the package they complete, which makes child-pays-for-parent work.
+ *
+ * To bound the cost of maintaining this state, AcceptToMemoryPool limits the
+ * number and size of ancestors and descendants of any new transaction
+ * (-limitancestorcount, -limitancestorsize, -limitdescendantcount and
+ * -limitdescendantsize).
  */
 class CTxMemPool
 {
@@ -140,8 +261,9 @@ private:
     uint64_t nRecentlyAddedSequence = 0;
     uint64_t nNotifiedSequence = 0;
 
-    std::map<uint256, const CTransaction*> mapSproutNullifiers;
-    std::map<uint256, const CTransaction*> mapSaplingNullifiers;
+    typedef boost::unordered_map<uint256, const CTransaction*, SaltedTxidHasher> nullifiersMap;
+    nullifiersMap mapSproutNullifiers;
+    nullifiersMap mapSaplingNullifiers;
     RecentlyEvictedList* recentlyEvicted = new RecentlyEvictedList(DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES * 60);
     WeightedTxTree* weightedTxTree = new WeightedTxTree(DEFAULT_MEMPOOL_TOTAL_COST_LIMIT);
 
@@ -157,6 +279,11 @@ public:
             boost::multi_index::ordered_non_unique<
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByFee
+            >,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
             >
         >
     > indexed_transaction_set;
@@ -164,15 +291,55 @@ public:
     mutable CCriticalSection cs;
     indexed_transaction_set mapTx;
 
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+
+    /** Update ancestors of hash to add/remove it as a descendant transaction. */
+    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    /** Set ancestor state for an entry */
+    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    /** Link a transaction that is being re-added from a disconnected block to
+     *  its in-mempool children, and fix up the cached state of everything that
+     *  is affected by the new relationship. */
+    void UpdateForDescendantsOfNew(txiter it);
+    /** Recompute the ancestor (or descendant) state of an entry from scratch. */
+    void RecalculateAncestorState(txiter it);
+    void RecalculateDescendantState(txiter it);
+    /** Before removing a set of entries from mapTx, update the cached state
+     *  of their ancestors and remaining descendants and drop their links. */
+    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove);
+
 private:
     // insightexplorer
+    // mapAddress stays ordered, as getaddressmempool reads it by address range.
     std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> mapAddress;
-    std::map<uint256, std::vector<CMempoolAddressDeltaKey> > mapAddressInserted;
-    std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpent;
-    std::map<uint256, std::vector<CSpentIndexKey>> mapSpentInserted;
+    boost::unordered_map<uint256, std::vector<CMempoolAddressDeltaKey>, SaltedTxidHasher> mapAddressInserted;
+    boost::unordered_map<CSpentIndexKey, CSpentIndexValue, SaltedSpentIndexKeyHasher> mapSpent;
+    boost::unordered_map<uint256, std::vector<CSpentIndexKey>, SaltedTxidHasher> mapSpentInserted;
 
 public:
-    std::map<COutPoint, CInPoint> mapNextTx;
+    typedef boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> nextTxMap;
+    nextTxMap mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
@@ -187,7 +354,12 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(double dFrequency = 1.0) { nCheckFrequency = static_cast<uint32_t>(dFrequency * 4294967295.0); }
 
+    // addUnchecked must update state for all ancestors of a given transaction,
+    // to track size/count of descendant transactions. The first version of
+    // addUnchecked can be used to have it call CalculateMemPoolAncestors(), and
+    // then invoke the second version.
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
 
     // START insightexplorer
     void addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
@@ -210,6 +382,9 @@ public:
     void removeWithoutBranchId(uint32_t nMemPoolBranchId);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    /** Like queryHashes, but in descending ancestor fee rate order, with every
+     *  transaction preceded by its in-mempool ancestors. */
+    void queryHashesByAncestorScore(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
@@ -226,6 +401,26 @@ public:
 
     bool nullifierExists(const uint256& nullifier, ShieldedType type) const;
 
+    /** Try to calculate all in-mempool ancestors of entry.
+     *  (these are all calculated including the tx itself)
+     *  limitAncestorCount = max number of ancestors
+     *  limitAncestorSize = max size of ancestors
+     *  limitDescendantCount = max number of descendants any ancestor can have
+     *  limitDescendantSize = max size of descendants any ancestor can have
+     *  errString = populated with error reason if any limits are hit
+     *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
+     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string &errString, bool fSearchForParents = true) const;
+
+    /** Populate setDescendants with all in-mempool descendants of hash.
+     *  Assumes that setDescendants includes all in-mempool descendants of anything
+     *  already in it.  */
+    void CalculateDescendants(txiter it, setEntries &setDescendants) const;
+
     std::pair<std::vector<CTransaction>, uint64_t> DrainRecentlyAdded();
     void SetNotifiedSequence(uint64_t recentlyAddedSequence);
     bool IsFullyNotified();
@@ -249,6 +444,15 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    bool lookupFeeRate(const uint256& hash, CFeeRate& feeRate) const;
+
+    /**
+     * The minimum fee rate a transaction should pay for us to want it relayed
+     * to us. Zero while the weighted tx tree is comfortably below its cost
+     * limit; once it nears the limit, the rate at which a minimum-cost
+     * transaction avoids the low fee eviction penalty.
+     */
+    CFeeRate GetMinFee() const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
@@ -260,6 +464,10 @@ public:
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
 
+    /** Write/Read the recently evicted list to disk; throws on failure */
+    void WriteRecentlyEvicted(CAutoFile& fileout) const;
+    void ReadRecentlyEvicted(CAutoFile& filein);
+
     size_t DynamicMemoryUsage() const;
 
     /** Return nCheckFrequency */